@@ -1,7 +1,22 @@
 #include "common.h"
 
+#include <stddef.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
 // wrapper functions for system calls
 void close_wrap(int fd, int num) { //num is used as id for debugging
+    reactor_drop(fd);
     if (close(fd) == -1) {
         fprintf(stderr, "Error closing (%d) fd %d: %s\n", fd, num, strerror(errno));
         exit(1);
@@ -9,9 +24,19 @@ void close_wrap(int fd, int num) { //num is used as id for debugging
 }
 
 void write_wrap(int fd, const void *buf, size_t nbyte, const char *msg) { //msg used for debug
-    if (write(fd, buf, nbyte) == -1) {
-        fprintf(stderr, "Error writing (%s): %s\n", msg, strerror(errno));
-        exit(1);
+    const char *p = buf;
+    while (nbyte > 0) {
+        ssize_t wcount = write(fd, p, nbyte);
+        if (wcount == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Error writing (%s): %s\n", msg, strerror(errno));
+            exit(1);
+        }
+        // a short write (signal, full pipe) leaves the rest to do
+        p += wcount;
+        nbyte -= wcount;
     }
 }
 
@@ -31,6 +56,951 @@ void dup_wrap(int fd, int num) { // num is used as id for debugging
     }
 }
 
+// used where one end of a connection going away should only end that
+// connection (e.g. one session of the server), not the whole program.
+// read_peer() returns 0 (EOF) and write_peer() returns -1 when the peer
+// is gone, any other error still exits. On a non-blocking fd with no
+// data read_peer() returns -1 with errno EAGAIN; write_peer() waits
+// until the whole buffer is written.
+int read_peer(int fd, void *buf, size_t nbyte, const char *msg) {
+    io_stats.syscalls++;
+    int rcount = read(fd, buf, nbyte);
+    if (rcount == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            errno = EAGAIN;
+            return -1;
+        }
+        if (errno == ECONNRESET || errno == EIO) {
+            return 0;
+        }
+        fprintf(stderr, "Error reading (%s): %s\n", msg, strerror(errno));
+        exit(1);
+    }
+    return rcount;
+}
+
+static int ring_active(void);
+static int ring_write(int fd, const void *buf, size_t nbyte);
+
+int write_peer(int fd, const void *buf, size_t nbyte, const char *msg) {
+    if (ring_active()) {
+        return ring_write(fd, buf, nbyte);
+    }
+    const char *p = buf;
+    while (nbyte > 0) {
+        io_stats.syscalls++;
+        ssize_t wcount = write(fd, p, nbyte);
+        if (wcount == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // peer is slow, wait for room
+                struct pollfd pfd = {fd, POLLOUT, 0};
+                io_stats.syscalls++;
+                if (poll(&pfd, 1, -1) == -1 && errno != EINTR) {
+                    fprintf(stderr, "Error polling (%s): %s\n", msg, strerror(errno));
+                    exit(1);
+                }
+                continue;
+            }
+            if (errno == EPIPE || errno == ECONNRESET) {
+                return -1;
+            }
+            fprintf(stderr, "Error writing (%s): %s\n", msg, strerror(errno));
+            exit(1);
+        }
+        p += wcount;
+        nbyte -= wcount;
+    }
+    return 0;
+}
+
+// move up to nbyte bytes from the pipe fd_in to fd_out inside the
+// kernel. Returns the bytes moved or 0 on EOF of the pipe. Returns -1
+// with errno EAGAIN when the pipe is empty, ENOSPC when fd_out is full,
+// EPIPE when the peer on fd_out is gone, or EINVAL when splice() cannot
+// be used for fd_out.
+int splice_peer(int fd_in, int fd_out, size_t nbyte, const char *msg) {
+    while (1) {
+        io_stats.syscalls++;
+        ssize_t moved = splice(fd_in, NULL, fd_out, NULL, nbyte,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (moved >= 0) {
+            return moved;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EAGAIN) {
+            // either the pipe is empty or fd_out is full
+            int pending;
+            io_stats.syscalls++;
+            if (ioctl(fd_in, FIONREAD, &pending) == -1) {
+                fprintf(stderr, "Error with ioctl (%s): %s\n", msg, strerror(errno));
+                exit(1);
+            }
+            errno = pending == 0 ? EAGAIN : ENOSPC;
+            return -1;
+        }
+        if (errno == EPIPE || errno == ECONNRESET) {
+            errno = EPIPE;
+            return -1;
+        }
+        if (errno == EINVAL) {
+            return -1;
+        }
+        fprintf(stderr, "Error with splice (%s): %s\n", msg, strerror(errno));
+        exit(1);
+    }
+}
+
+socklen_t unix_address(struct sockaddr_un *addr, const char *path) {
+    size_t len = strlen(path);
+    if (len == 0 || len >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "Error with Unix socket path %s: must be 1 to %zu bytes\n",
+                path, sizeof(addr->sun_path) - 1);
+        exit(1);
+    }
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    memcpy(addr->sun_path, path, len);
+    if (path[0] == '@') {
+        addr->sun_path[0] = '\0'; // abstract, the name is not terminated
+        return offsetof(struct sockaddr_un, sun_path) + len;
+    }
+    return sizeof(struct sockaddr_un);
+}
+
+void set_nonblock(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        fprintf(stderr, "Error setting O_NONBLOCK on fd %d: %s\n", fd, strerror(errno));
+        exit(1);
+    }
+}
+
+// event loop
+int reactor_create(void) {
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1) {
+        fprintf(stderr, "Error creating epoll instance: %s\n", strerror(errno));
+        exit(1);
+    }
+    return epfd;
+}
+
+void reactor_add(int epfd, struct event *ev, uint32_t events) {
+    struct epoll_event ee;
+    ee.events = events;
+    ee.data.ptr = ev;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, ev->fd, &ee) == -1) {
+        fprintf(stderr, "Error adding fd %d to epoll: %s\n", ev->fd, strerror(errno));
+        exit(1);
+    }
+}
+
+// must be called before ev->fd is closed if the fd may have been dup'ed
+// (e.g. by a forked child), otherwise closing is enough
+void reactor_del(int epfd, struct event *ev) {
+    if (epoll_ctl(epfd, EPOLL_CTL_DEL, ev->fd, NULL) == -1 && errno != EBADF && errno != ENOENT) {
+        fprintf(stderr, "Error removing fd %d from epoll: %s\n", ev->fd, strerror(errno));
+        exit(1);
+    }
+}
+
+// io_uring backend
+// Raw system calls, liburing is not needed. A write in flight takes one
+// of RING_BUFS registered buffers, one per fd at a time so the writes
+// of an fd complete in order; what comes after it waits in the fd's
+// outq and goes into the buffer once that is written. A write that hits
+// a full socket (-EAGAIN with RWF_NOWAIT) puts the rest back in front of
+// the outq and gives up its buffer while it waits for POLLOUT through
+// the ring, so peers that stop reading never hold buffers.
+// With every buffer in flight an fd waits in line for the next one to
+// complete instead of blocking the thread.
+#define RING_ENTRIES 256
+#define RING_BUFS 64
+#define RING_BUF_SIZE FRAME_BOUND(FRAME_BURST) // a whole frame in one buffer
+#define RING_EPOLL 0                // user_data of the poll on the epoll fd
+#define RING_POLLOUT (1ULL << 32)   // user_data flag: POLLOUT wait of a write
+#define RING_CANCEL (1ULL << 33)    // user_data of a cancel, nothing to do
+
+struct ring_write {
+    int fd;        // -1 once the fd is closed under the write
+    size_t off, len;
+    int next; // next free buffer
+};
+
+struct ring_fd {
+    int slot;      // buffer of the write in flight, -1 for none
+    int polling;   // waiting for POLLOUT, without a buffer
+    int queued;    // waiting in line for a free buffer
+    int next;      // next fd in that line
+    int failed;    // a write failed, refuse the rest
+    struct outq q; // bytes not in a buffer yet
+};
+
+static void outq_append(struct outq *q, const char *buf, size_t nbyte);
+static void outq_prepend(struct outq *q, const char *buf, size_t nbyte);
+
+static __thread struct {
+    int fd; // -1 while the epoll path is used
+    int epfd;
+    unsigned entries;
+    unsigned *sq_head, *sq_tail, *sq_mask;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned to_submit;
+    char *bufs;
+    struct ring_write w[RING_BUFS];
+    int free_list;
+    int wait_head, wait_tail; // fds waiting for a free buffer
+    struct ring_fd *fds;
+    int nfds;
+    int poll_armed, epoll_ready;
+} ring = {.fd = -1};
+
+static int ring_active(void) {
+    return ring.fd != -1;
+}
+
+static void ring_enter(unsigned wait, int timeout) {
+    struct __kernel_timespec ts = {timeout / 1000, (timeout % 1000) * 1000000LL};
+    struct io_uring_getevents_arg arg = {0, 0, 0, (uint64_t)(uintptr_t)&ts};
+    unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+    if (wait && timeout >= 0) {
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+    io_stats.syscalls++;
+    int n = syscall(__NR_io_uring_enter, ring.fd, ring.to_submit, wait, flags,
+                    flags & IORING_ENTER_EXT_ARG ? (void *)&arg : NULL,
+                    flags & IORING_ENTER_EXT_ARG ? sizeof(arg) : 0);
+    if (n >= 0) {
+        ring.to_submit -= n;
+    }
+    else if (errno != EINTR && errno != ETIME && errno != EBUSY && errno != EAGAIN) {
+        fprintf(stderr, "Error with io_uring_enter: %s\n", strerror(errno));
+        exit(1);
+    }
+}
+
+// next free submission entry, submitting the queued ones if it is full
+static struct io_uring_sqe *ring_sqe(void) {
+    unsigned tail = *ring.sq_tail;
+    if (tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) == ring.entries) {
+        ring_enter(0, -1);
+    }
+    struct io_uring_sqe *sqe = &ring.sqes[tail & *ring.sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring.to_submit++;
+    return sqe;
+}
+
+static void ring_submit_write(int slot) {
+    struct ring_write *w = &ring.w[slot];
+    struct io_uring_sqe *sqe = ring_sqe();
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->fd = w->fd;
+    sqe->addr = (uint64_t)(uintptr_t)(ring.bufs + (size_t)slot * RING_BUF_SIZE + w->off);
+    sqe->len = w->len - w->off;
+    sqe->buf_index = slot;
+    sqe->rw_flags = RWF_NOWAIT; // -EAGAIN on a full socket, not parked with its buffer
+    sqe->user_data = slot + 1;
+}
+
+// move the next bytes queued for fd into slot and write them
+static void ring_fill(int slot, int fd) {
+    struct ring_fd *f = &ring.fds[fd];
+    size_t len = f->q.end - f->q.start;
+    if (len > RING_BUF_SIZE) {
+        len = RING_BUF_SIZE;
+    }
+    memcpy(ring.bufs + (size_t)slot * RING_BUF_SIZE, f->q.buf + f->q.start, len);
+    f->q.start += len;
+    if (f->q.start == f->q.end) {
+        outq_free(&f->q);
+    }
+    ring.w[slot] = (struct ring_write){fd, 0, len, -1};
+    f->slot = slot;
+    ring_submit_write(slot);
+}
+
+// slot is free again: the first fd in line gets it
+static void ring_free(int slot) {
+    if (ring.wait_head != -1) {
+        int fd = ring.wait_head;
+        ring.wait_head = ring.fds[fd].next;
+        ring.fds[fd].queued = 0;
+        ring_fill(slot, fd);
+        return;
+    }
+    ring.w[slot].next = ring.free_list;
+    ring.free_list = slot;
+}
+
+// fd has bytes queued and no buffer: take a free one or get in line
+static void ring_start(int fd) {
+    struct ring_fd *f = &ring.fds[fd];
+    if (ring.free_list != -1) {
+        int slot = ring.free_list;
+        ring.free_list = ring.w[slot].next;
+        ring_fill(slot, fd);
+        return;
+    }
+    f->queued = 1;
+    f->next = -1;
+    if (ring.wait_head == -1) {
+        ring.wait_head = fd;
+    }
+    else {
+        ring.fds[ring.wait_tail].next = fd;
+    }
+    ring.wait_tail = fd;
+}
+
+// a write of slot completed with result res
+static void ring_written(int slot, int res) {
+    struct ring_write *w = &ring.w[slot];
+    int fd = w->fd;
+    if (fd == -1) {
+        ring_free(slot); // dropped by reactor_drop()
+        return;
+    }
+    struct ring_fd *f = &ring.fds[fd];
+    if (res == -EINTR || (res >= 0 && (w->off += res) < w->len)) {
+        ring_submit_write(slot);
+        return;
+    }
+    f->slot = -1;
+    if (res == -EAGAIN) {
+        // the socket is full: keep the rest, not the buffer
+        outq_prepend(&f->q, ring.bufs + (size_t)slot * RING_BUF_SIZE + w->off, w->len - w->off);
+        ring_free(slot);
+        struct io_uring_sqe *sqe = ring_sqe();
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = fd;
+        sqe->poll32_events = POLLOUT;
+        sqe->user_data = RING_POLLOUT | fd;
+        f->polling = 1;
+        return;
+    }
+    if (res < 0) {
+        if (res != -EPIPE && res != -ECONNRESET) {
+            fprintf(stderr, "Error writing (fd %d): %s\n", fd, strerror(-res));
+        }
+        // the peer is gone, drop what is queued for it
+        f->failed = 1;
+        outq_free(&f->q);
+    }
+    if (f->q.start < f->q.end) {
+        ring_fill(slot, fd);
+    }
+    else {
+        ring_free(slot);
+    }
+}
+
+// handle every completion there is
+static void ring_reap(void) {
+    unsigned head = *ring.cq_head;
+    while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+        uint64_t data = cqe->user_data;
+        int res = cqe->res;
+        __atomic_store_n(ring.cq_head, ++head, __ATOMIC_RELEASE);
+        if (data == RING_EPOLL) {
+            ring.poll_armed = 0;
+            ring.epoll_ready = 1;
+        }
+        else if (data & RING_CANCEL) {
+            continue;
+        }
+        else if (data & RING_POLLOUT) {
+            // a poll cancelled by reactor_drop() may complete after the
+            // fd number is reused: at worst that retries a write early
+            int fd = data & ~RING_POLLOUT;
+            if (ring.fds[fd].polling) {
+                ring.fds[fd].polling = 0;
+                ring_start(fd);
+            }
+        }
+        else {
+            ring_written(data - 1, res);
+        }
+        head = *ring.cq_head;
+    }
+}
+
+// queue nbyte bytes for fd, see reactor_uring() in common.h
+static int ring_write(int fd, const void *buf, size_t nbyte) {
+    if (fd >= ring.nfds) {
+        int n = ring.nfds ? ring.nfds : 64;
+        while (n <= fd) {
+            n *= 2;
+        }
+        ring.fds = realloc(ring.fds, n * sizeof(struct ring_fd));
+        if (ring.fds == NULL) {
+            fprintf(stderr, "Error allocating io_uring fds: %s\n", strerror(errno));
+            exit(1);
+        }
+        for (; ring.nfds < n; ring.nfds++) {
+            ring.fds[ring.nfds] = (struct ring_fd){-1, 0, 0, -1, 0, {NULL, 0, 0}};
+        }
+    }
+    struct ring_fd *f = &ring.fds[fd];
+    const char *p = buf;
+    if (f->failed) {
+        return -1;
+    }
+    // straight into a free buffer when nothing is waiting before it
+    int idle = f->slot == -1 && !f->polling && !f->queued;
+    if (idle && nbyte > 0 && ring.free_list != -1) {
+        int slot = ring.free_list;
+        ring.free_list = ring.w[slot].next;
+        size_t len = nbyte < RING_BUF_SIZE ? nbyte : RING_BUF_SIZE;
+        memcpy(ring.bufs + (size_t)slot * RING_BUF_SIZE, p, len);
+        ring.w[slot] = (struct ring_write){fd, 0, len, -1};
+        f->slot = slot;
+        ring_submit_write(slot);
+        p += len;
+        nbyte -= len;
+        idle = 0;
+    }
+    if (nbyte > 0) {
+        outq_append(&f->q, p, nbyte);
+        if (idle) {
+            ring_start(fd); // every buffer in flight
+        }
+    }
+    return 0;
+}
+
+static void ring_cancel(uint64_t data) {
+    struct io_uring_sqe *sqe = ring_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = data;
+    sqe->user_data = RING_CANCEL;
+}
+
+void reactor_drop(int fd) {
+    if (!ring_active() || fd >= ring.nfds) {
+        return;
+    }
+    struct ring_fd *f = &ring.fds[fd];
+    if (f->queued) {
+        // take fd out of the line for a buffer
+        int prev = -1;
+        for (int i = ring.wait_head; i != fd; i = ring.fds[i].next) {
+            prev = i;
+        }
+        if (prev == -1) {
+            ring.wait_head = f->next;
+        }
+        else {
+            ring.fds[prev].next = f->next;
+        }
+        if (ring.wait_tail == fd) {
+            ring.wait_tail = prev;
+        }
+    }
+    if (f->slot != -1) {
+        ring.w[f->slot].fd = -1; // the slot is freed when the write completes
+        ring_cancel(f->slot + 1);
+    }
+    if (f->polling) {
+        ring_cancel(RING_POLLOUT | fd);
+    }
+    outq_free(&f->q);
+    *f = (struct ring_fd){-1, 0, 0, -1, 0, {NULL, 0, 0}};
+    if (ring.to_submit > 0) {
+        ring_enter(0, -1); // submitted before the fd number can be reused
+    }
+}
+// bytes queued in the ring for fd and not written yet
+static size_t ring_queued(int fd) {
+    if (fd < 0 || fd >= ring.nfds) {
+        return 0;
+    }
+    struct ring_fd *f = &ring.fds[fd];
+    size_t queued = f->q.end - f->q.start;
+    if (f->slot != -1) {
+        queued += ring.w[f->slot].len - ring.w[f->slot].off;
+    }
+    return queued;
+}
+
+// output queues
+// Without io_uring the data goes straight to the fd while nothing is
+// queued, and only what the fd does not take is copied into a pool
+// buffer that grows as needed (the callers keep it under OUTQ_HIGH,
+// give or take one burst) and goes back to the pool once written.
+static void outq_append(struct outq *q, const char *buf, size_t nbyte) {
+    if (q->start > 0) {
+        memmove(q->buf, q->buf + q->start, q->end - q->start);
+        q->end -= q->start;
+        q->start = 0;
+    }
+    if (q->buf == NULL || q->end + nbyte > pool_size(q->buf)) {
+        char *grown = pool_get(q->end + nbyte);
+        if (q->end > 0) {
+            memcpy(grown, q->buf, q->end);
+        }
+        pool_put(q->buf);
+        q->buf = grown;
+    }
+    memcpy(q->buf + q->end, buf, nbyte);
+    q->end += nbyte;
+}
+
+// put nbyte bytes back in front of what q holds
+static void outq_prepend(struct outq *q, const char *buf, size_t nbyte) {
+    if (q->start >= nbyte) {
+        q->start -= nbyte;
+        memcpy(q->buf + q->start, buf, nbyte);
+        return;
+    }
+    size_t pending = q->end - q->start;
+    char *grown = pool_get(nbyte + pending);
+    memcpy(grown, buf, nbyte);
+    if (pending > 0) {
+        memcpy(grown + nbyte, q->buf + q->start, pending);
+    }
+    pool_put(q->buf);
+    q->buf = grown;
+    q->start = 0;
+    q->end = nbyte + pending;
+}
+
+int outq_flush(struct outq *q, int fd, const char *msg) {
+    while (q->start < q->end) {
+        io_stats.syscalls++;
+        ssize_t wcount = write(fd, q->buf + q->start, q->end - q->start);
+        if (wcount == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0; // the rest on the next EPOLLOUT
+            }
+            if (errno == EPIPE || errno == ECONNRESET) {
+                return -1;
+            }
+            fprintf(stderr, "Error writing (%s): %s\n", msg, strerror(errno));
+            exit(1);
+        }
+        q->start += wcount;
+    }
+    outq_free(q);
+    return 0;
+}
+
+int outq_write(struct outq *q, int fd, const void *buf, size_t nbyte, const char *msg) {
+    if (ring_active()) {
+        return ring_write(fd, buf, nbyte);
+    }
+    const char *p = buf;
+    if (q->start == q->end) {
+        while (nbyte > 0) {
+            io_stats.syscalls++;
+            ssize_t wcount = write(fd, p, nbyte);
+            if (wcount == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    break;
+                }
+                if (errno == EPIPE || errno == ECONNRESET) {
+                    return -1;
+                }
+                fprintf(stderr, "Error writing (%s): %s\n", msg, strerror(errno));
+                exit(1);
+            }
+            p += wcount;
+            nbyte -= wcount;
+        }
+    }
+    if (nbyte > 0) {
+        outq_append(q, p, nbyte);
+    }
+    return 0;
+}
+
+size_t outq_pending(struct outq *q, int fd) {
+    return q->end - q->start + (ring_active() ? ring_queued(fd) : 0);
+}
+
+void outq_free(struct outq *q) {
+    pool_put(q->buf);
+    q->buf = NULL;
+    q->start = q->end = 0;
+}
+
+int reactor_uring(int epfd) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = 4 * RING_ENTRIES;
+    int fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+    if (fd == -1) {
+        return -1;
+    }
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)) {
+        close(fd);
+        errno = ENOSYS;
+        return -1;
+    }
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    size_t size = sq_size > cq_size ? sq_size : cq_size;
+    char *sq = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                    IORING_OFF_SQ_RING);
+    struct io_uring_sqe *sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                                     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                                     IORING_OFF_SQES);
+    char *bufs = mmap(NULL, (size_t)RING_BUFS * RING_BUF_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (sq == MAP_FAILED || sqes == MAP_FAILED || bufs == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    // forked shells must not share (and copy-on-write) the pinned buffers
+    madvise(bufs, (size_t)RING_BUFS * RING_BUF_SIZE, MADV_DONTFORK);
+    struct iovec iov[RING_BUFS];
+    int i;
+    for (i = 0; i < RING_BUFS; i++) {
+        iov[i].iov_base = bufs + (size_t)i * RING_BUF_SIZE;
+        iov[i].iov_len = RING_BUF_SIZE;
+    }
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, iov, RING_BUFS) == -1) {
+        close(fd);
+        return -1;
+    }
+    ring.epfd = epfd;
+    ring.entries = p.sq_entries;
+    ring.sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    // submission entries are used in ring order
+    unsigned *array = (unsigned *)(sq + p.sq_off.array);
+    for (i = 0; i < (int)p.sq_entries; i++) {
+        array[i] = i;
+    }
+    ring.sqes = sqes;
+    ring.cq_head = (unsigned *)(sq + p.cq_off.head);
+    ring.cq_tail = (unsigned *)(sq + p.cq_off.tail);
+    ring.cq_mask = (unsigned *)(sq + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(sq + p.cq_off.cqes);
+    ring.bufs = bufs;
+    ring.free_list = -1;
+    ring.wait_head = ring.wait_tail = -1;
+    for (i = RING_BUFS - 1; i >= 0; i--) {
+        ring_free(i);
+    }
+    ring.fd = fd;
+    return 0;
+}
+
+// wait up to timeout ms (-1 forever) and run the handlers of ready fds.
+// Returns the number of events handled, 0 on timeout or signal.
+// Handlers must not free another struct event that may be in the same
+// batch; defer freeing until reactor_run() returns.
+int reactor_run(int epfd, int timeout) {
+    struct epoll_event events[64];
+    if (ring_active() && epfd == ring.epfd) {
+        // submit the queued writes and wait for the epoll fd together
+        if (!ring.poll_armed && !ring.epoll_ready) {
+            struct io_uring_sqe *sqe = ring_sqe();
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->fd = epfd;
+            sqe->poll32_events = POLLIN;
+            sqe->user_data = RING_EPOLL;
+            ring.poll_armed = 1;
+        }
+        if (!ring.epoll_ready) {
+            ring_enter(1, timeout);
+            ring_reap();
+        }
+        if (!ring.epoll_ready) {
+            return 0; // only writes completed, or timeout
+        }
+        ring.epoll_ready = 0;
+        timeout = 0;
+    }
+    io_stats.syscalls++;
+    int n = epoll_wait(epfd, events, 64, timeout);
+    if (n == -1) {
+        if (errno == EINTR) {
+            return 0;
+        }
+        fprintf(stderr, "Error waiting on epoll: %s\n", strerror(errno));
+        exit(1);
+    }
+    if (n > 0) {
+        io_stats.wakeups++;
+        io_stats.events += n;
+    }
+    uint64_t woken = io_stats.timing ? now_ns() : 0;
+    int i;
+    for (i = 0; i < n; i++) {
+        struct event *ev = events[i].data.ptr;
+        if (io_stats.timing) {
+            histogram_add(&io_stats.queue, now_ns() - woken);
+        }
+        ev->handler(ev, events[i].events);
+    }
+    return n;
+}
+
+// statistics
+__thread struct io_stats io_stats;
+
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+void histogram_add(struct histogram *h, uint64_t ns) {
+    int i = 0;
+    uint64_t us = ns >> 10; // close enough to us for bucketing
+    while (us > 0 && i < HIST_BUCKETS - 1) {
+        us >>= 1;
+        i++;
+    }
+    h->count++;
+    h->sum_ns += ns;
+    h->bucket[i]++;
+}
+
+// add the counts of h to into
+void histogram_merge(struct histogram *into, const struct histogram *h) {
+    int i;
+    into->count += h->count;
+    into->sum_ns += h->sum_ns;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        into->bucket[i] += h->bucket[i];
+    }
+}
+
+// write h in the Prometheus text format as histogram name (in seconds)
+// with the extra labels (e.g. direction="in", or "")
+void histogram_print(FILE *out, const char *name, const char *labels, struct histogram *h) {
+    const char *sep = labels[0] ? "," : "";
+    uint64_t cum = 0;
+    int i;
+    for (i = 0; i < HIST_BUCKETS - 1; i++) {
+        cum += h->bucket[i];
+        fprintf(out, "%s_bucket{%s%sle=\"%g\"} %llu\n", name, labels, sep,
+                (double)(1024ULL << i) / 1e9, (unsigned long long)cum);
+    }
+    fprintf(out, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, sep,
+            (unsigned long long)h->count);
+    const char *open = labels[0] ? "{" : "", *close = labels[0] ? "}" : "";
+    fprintf(out, "%s_sum%s%s%s %.9f\n", name, open, labels, close, h->sum_ns / 1e9);
+    fprintf(out, "%s_count%s%s%s %llu\n", name, open, labels, close,
+            (unsigned long long)h->count);
+}
+
+// buffer pool
+// Buffers come in power-of-two size classes from POOL_MIN bytes up.
+// A returned buffer goes on the free list of its class (up to POOL_KEEP
+// of them), so the event loops stop allocating once warmed up and an
+// idle session holds no I/O buffers at all.
+#define POOL_MIN_SHIFT 9 // 512 bytes
+#define POOL_CLASSES 16  // up to 16 MiB
+#define POOL_KEEP 64
+
+struct pool_hdr {
+    struct pool_hdr *next; // while on a free list
+    size_t cls;
+} __attribute__((aligned(16)));
+
+static __thread struct pool_hdr *pool_free[POOL_CLASSES];
+static __thread int pool_nfree[POOL_CLASSES];
+
+void *pool_get(size_t size) {
+    size_t cls = 0;
+    while (((size_t)1 << (cls + POOL_MIN_SHIFT)) < size) {
+        cls++;
+    }
+    if (cls >= POOL_CLASSES) {
+        fprintf(stderr, "Error allocating buffer: %zu bytes is too large\n", size);
+        exit(1);
+    }
+    struct pool_hdr *h = pool_free[cls];
+    if (h != NULL) {
+        pool_free[cls] = h->next;
+        pool_nfree[cls]--;
+    }
+    else {
+        h = malloc(sizeof(struct pool_hdr) + ((size_t)1 << (cls + POOL_MIN_SHIFT)));
+        if (h == NULL) {
+            fprintf(stderr, "Error allocating buffer: %s\n", strerror(errno));
+            exit(1);
+        }
+        h->cls = cls;
+    }
+    return h + 1;
+}
+
+void pool_put(void *buf) {
+    if (buf == NULL) {
+        return;
+    }
+    struct pool_hdr *h = (struct pool_hdr *)buf - 1;
+    if (pool_nfree[h->cls] >= POOL_KEEP) {
+        free(h);
+        return;
+    }
+    h->next = pool_free[h->cls];
+    pool_free[h->cls] = h;
+    pool_nfree[h->cls]++;
+}
+
+// usable size of a buffer from pool_get()
+size_t pool_size(void *buf) {
+    struct pool_hdr *h = (struct pool_hdr *)buf - 1;
+    return (size_t)1 << (h->cls + POOL_MIN_SHIFT);
+}
+
+// terminal stream scanning
+// The set of special bytes is given as SCAN_* bits; at most four bytes
+// (CR, LF, ^C, ^D) are looked for at once.
+static int scan_bytes(int set, unsigned char *bytes) {
+    int n = 0;
+    if (set & SCAN_CR)  bytes[n++] = 0x0D;
+    if (set & SCAN_LF)  bytes[n++] = 0x0A;
+    if (set & SCAN_ETX) bytes[n++] = 0x03;
+    if (set & SCAN_EOT) bytes[n++] = 0x04;
+    return n;
+}
+
+static size_t scan_scalar(const char *buf, size_t nbyte, const unsigned char *bytes, int n) {
+    size_t i;
+    int j;
+    for (i = 0; i < nbyte; i++) {
+        for (j = 0; j < n; j++) {
+            if ((unsigned char)buf[i] == bytes[j]) {
+                return i;
+            }
+        }
+    }
+    return nbyte;
+}
+
+#if defined(__x86_64__)
+// SSE2 is always there on x86-64, AVX2 is checked for at run time
+static size_t scan_sse2(const char *buf, size_t nbyte, const unsigned char *bytes, int n) {
+    __m128i c[4];
+    int j;
+    for (j = 0; j < n; j++) {
+        c[j] = _mm_set1_epi8(bytes[j]);
+    }
+    size_t i = 0;
+    for (; i + 16 <= nbyte; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+        __m128i m = _mm_cmpeq_epi8(v, c[0]);
+        for (j = 1; j < n; j++) {
+            m = _mm_or_si128(m, _mm_cmpeq_epi8(v, c[j]));
+        }
+        int mask = _mm_movemask_epi8(m);
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + scan_scalar(buf + i, nbyte - i, bytes, n);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_avx2(const char *buf, size_t nbyte, const unsigned char *bytes, int n) {
+    __m256i c[4];
+    int j;
+    for (j = 0; j < n; j++) {
+        c[j] = _mm256_set1_epi8(bytes[j]);
+    }
+    size_t i = 0;
+    for (; i + 32 <= nbyte; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+        __m256i m = _mm256_cmpeq_epi8(v, c[0]);
+        for (j = 1; j < n; j++) {
+            m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, c[j]));
+        }
+        unsigned int mask = _mm256_movemask_epi8(m);
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + scan_sse2(buf + i, nbyte - i, bytes, n);
+}
+#endif
+
+// index of the first byte of buf in set, nbyte if there is none
+size_t scan_special(const char *buf, size_t nbyte, int set) {
+    unsigned char bytes[4];
+    int n = scan_bytes(set, bytes);
+    if (n == 0) {
+        return nbyte;
+    }
+#if defined(__x86_64__)
+    static int have_avx2 = -1;
+    if (have_avx2 == -1) {
+        have_avx2 = __builtin_cpu_supports("avx2");
+    }
+    if (have_avx2) {
+        return scan_avx2(buf, nbyte, bytes, n);
+    }
+    return scan_sse2(buf, nbyte, bytes, n);
+#else
+    return scan_scalar(buf, nbyte, bytes, n);
+#endif
+}
+
+// copy nbyte bytes of src to dst, writing <cr><lf> for every byte in
+// set. dst needs room for 2 * nbyte bytes. Returns the bytes written.
+size_t translate_crlf(char *dst, const char *src, size_t nbyte, int set) {
+    char *out = dst;
+    size_t i = 0;
+    while (i < nbyte) {
+        size_t run = scan_special(src + i, nbyte - i, set);
+        memcpy(out, src + i, run);
+        out += run;
+        i += run;
+        if (i < nbyte) {
+            *out++ = 0x0D;
+            *out++ = 0x0A;
+            i++;
+        }
+    }
+    return out - dst;
+}
+
+// map every <cr> in buf to <lf>
+void map_cr_lf(char *buf, size_t nbyte) {
+    size_t i = 0;
+#if defined(__x86_64__)
+    // <cr> ^ <lf> == 0x07, flip those bits where a <cr> is
+    const __m128i cr = _mm_set1_epi8(0x0D);
+    const __m128i flip = _mm_set1_epi8(0x0D ^ 0x0A);
+    for (; i + 16 <= nbyte; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+        __m128i m = _mm_cmpeq_epi8(v, cr);
+        if (_mm_movemask_epi8(m) != 0) {
+            v = _mm_xor_si128(v, _mm_and_si128(m, flip));
+            _mm_storeu_si128((__m128i *)(buf + i), v);
+        }
+    }
+#endif
+    for (; i < nbyte; i++) {
+        if (buf[i] == 0x0D) {
+            buf[i] = 0x0A;
+        }
+    }
+}
+
 // compress functions
 void check_Z_OK(int status, char * msg) {
     if (status != Z_OK) {
@@ -47,91 +1017,1009 @@ void check_stream_error(int status, char * msg) {
 }
 
 
-int zcompress_new(void *tmp_buf, void *buf, size_t bytes_read, size_t buf_size) {
+// zlib codec
+// streams live as long as the connection; see common.h
+struct zstate {
+    z_stream deflate_stream;
+    z_stream inflate_stream;
+    const void *dict; // preset dictionary or NULL
+    size_t dict_len;
+};
+
+static void *zstate_init(int level, const void *dict, size_t dict_len) {
     int status;
-    int new_bytes;
-    unsigned char compress_buf[buf_size];
-    z_stream compress_stream;
-    
-    compress_stream.zalloc = Z_NULL;
-    compress_stream.zfree = Z_NULL;
-    compress_stream.opaque = Z_NULL;
-    
-    compress_stream.avail_in = bytes_read;
-    compress_stream.next_in = buf;
-    
-    status = deflateInit(&compress_stream, Z_DEFAULT_COMPRESSION);
+    struct zstate *z = malloc(sizeof(struct zstate));
+    if (z == NULL) {
+        fprintf(stderr, "Error allocating zlib state: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    z->deflate_stream.zalloc = Z_NULL;
+    z->deflate_stream.zfree = Z_NULL;
+    z->deflate_stream.opaque = Z_NULL;
+    status = deflateInit(&z->deflate_stream, level ? level : Z_DEFAULT_COMPRESSION);
     check_Z_OK(status, "deflateInit()");
-    
-    compress_stream.avail_out = buf_size;
-    compress_stream.next_out = compress_buf;
-    status = deflate(&compress_stream, Z_FINISH);
-    check_stream_error(status, "deflate()");
-    new_bytes = buf_size - compress_stream.avail_out;
-    memcpy(tmp_buf, compress_buf, new_bytes);
-    
-    deflateEnd(&compress_stream);
-    
-    return new_bytes;
+    z->dict = dict;
+    z->dict_len = dict_len;
+    if (dict != NULL) {
+        status = deflateSetDictionary(&z->deflate_stream, dict, dict_len);
+        check_Z_OK(status, "deflateSetDictionary()");
+    }
+
+    z->inflate_stream.zalloc = Z_NULL;
+    z->inflate_stream.zfree = Z_NULL;
+    z->inflate_stream.opaque = Z_NULL;
+    z->inflate_stream.avail_in = 0;
+    z->inflate_stream.next_in = Z_NULL;
+    status = inflateInit(&z->inflate_stream);
+    check_Z_OK(status, "inflateInit()");
+    return z;
+}
+
+static void zstate_end(void *state) {
+    struct zstate *z = state;
+    deflateEnd(&z->deflate_stream);
+    inflateEnd(&z->inflate_stream);
+    free(z);
 }
 
-int zcompress(int fd, void *buf, size_t bytes_read, size_t buf_size) {
+// compress bytes_read bytes of buf into tmp_buf, which has room for
+// buf_size >= CODEC_BOUND(bytes_read) bytes. Returns the compressed
+// size; the message ends on a sync flush so the peer can decode all of it.
+static int zcompress_new(void *state, void *tmp_buf, size_t buf_size, const void *buf, size_t bytes_read) {
     int status;
     int new_bytes;
-    unsigned char compress_buf[buf_size];
-    z_stream compress_stream;
-    
-    compress_stream.zalloc = Z_NULL;
-    compress_stream.zfree = Z_NULL;
-    compress_stream.opaque = Z_NULL;
-    
-    compress_stream.avail_in = bytes_read;
-    compress_stream.next_in = buf;
-    
-    if ((status = deflateInit(&compress_stream, Z_DEFAULT_COMPRESSION)) != Z_OK) {
-        fprintf(stderr, "Error with deflateInit(): returned %d\n", status);
-        exit(1);
-    }
-    
-    do {
-        compress_stream.avail_out = buf_size;
-        compress_stream.next_out = compress_buf;
-        status = deflate(&compress_stream, Z_FINISH);
-        new_bytes = buf_size - compress_stream.avail_out;
-        write_wrap(fd, compress_buf, new_bytes, "compress w");
-    } while(compress_stream.avail_out == 0);
-    
-    deflateEnd(&compress_stream);
-    
+    struct zstate *z = state;
+    z_stream *compress_stream = &z->deflate_stream;
+
+    compress_stream->avail_in = bytes_read;
+    compress_stream->next_in = (Bytef *)buf;
+    compress_stream->avail_out = buf_size;
+    compress_stream->next_out = tmp_buf;
+
+    status = deflate(compress_stream, Z_SYNC_FLUSH);
+    check_stream_error(status, "deflate()");
+    if (compress_stream->avail_in != 0 || compress_stream->avail_out == 0) {
+        fprintf(stderr, "Error with deflate(): output buffer too small\n");
+        exit(1);
+    }
+    new_bytes = buf_size - compress_stream->avail_out;
+
     return new_bytes;
 }
 
-int zdecompress_old(void *buf, size_t bytes_read, size_t buf_size) {
+// inflate one message and hand it to handle() in pieces of up to
+// out_size bytes. Returns -1 if the data is not a valid stream.
+static int zdecompress(void *state, const void *buf, size_t bytes_read, void *out, size_t out_size,
+                       void (*handle)(void *arg, char *buf, int nbyte), void *arg) {
     int status;
-    int new_bytes;
-    unsigned char inflate_buf[buf_size];
-    z_stream inflate_stream;
-    
-    inflate_stream.zalloc = Z_NULL;
-    inflate_stream.zfree = Z_NULL;
-    inflate_stream.opaque = Z_NULL;
-    
-    
-    inflate_stream.avail_in = bytes_read;
-    inflate_stream.next_in = buf;
-    inflate_stream.avail_out = buf_size;
-    inflate_stream.next_out = inflate_buf;
-    
-    
-    status = inflateInit(&inflate_stream);
-    check_Z_OK(status, "deflateInit()");
-    
-    status = inflate(&inflate_stream, Z_FINISH);
-    check_stream_error(status, "inflate()");
-    new_bytes = buf_size - inflate_stream.avail_out;
-    inflateEnd(&inflate_stream);
-    
-    memcpy(buf, inflate_buf, buf_size);
-    return new_bytes;
+    struct zstate *z = state;
+    z_stream *inflate_stream = &z->inflate_stream;
+
+    inflate_stream->avail_in = bytes_read;
+    inflate_stream->next_in = (Bytef *)buf;
+    while (1) {
+        inflate_stream->avail_out = out_size;
+        inflate_stream->next_out = out;
+
+        status = inflate(inflate_stream, Z_SYNC_FLUSH);
+        check_stream_error(status, "inflate()");
+        // the stream header asks for the preset dictionary
+        if (status == Z_NEED_DICT && z->dict != NULL) {
+            status = inflateSetDictionary(inflate_stream, z->dict, z->dict_len);
+            if (status != Z_OK) {
+                fprintf(stderr, "Error with inflateSetDictionary(): returned %d\n", status);
+                return -1;
+            }
+            continue;
+        }
+        if (status == Z_BUF_ERROR) {
+            return 0; // no input left and nothing pending
+        }
+        if (status != Z_OK) {
+            fprintf(stderr, "Error with inflate(): returned %d\n", status);
+            return -1;
+        }
+        if (inflate_stream->avail_out < out_size) {
+            handle(arg, out, out_size - inflate_stream->avail_out);
+        }
+        if (inflate_stream->avail_in == 0 && inflate_stream->avail_out > 0) {
+            return 0;
+        }
+    }
+}
+
+#ifdef HAVE_LZ4
+// LZ4 codec
+// Block compression with the previous data as dictionary. The payload
+// starts with the uncompressed size (4 bytes, network byte order) since
+// LZ4 blocks are decoded in one piece.
+#define LZ4_HISTORY (64 * 1024)
+
+struct lz4_state {
+    LZ4_stream_t *stream;
+    int acceleration;
+    char enc_dict[LZ4_HISTORY];
+    char dec_dict[LZ4_HISTORY]; // last decoded bytes
+    int dec_dict_len;
+};
+
+static void *lz4_init(int level, const void *dict, size_t dict_len) {
+    struct lz4_state *l = malloc(sizeof(struct lz4_state));
+    if (l == NULL || (l->stream = LZ4_createStream()) == NULL) {
+        fprintf(stderr, "Error allocating LZ4 state: %s\n", strerror(errno));
+        exit(1);
+    }
+    l->acceleration = level ? level : 1;
+    l->dec_dict_len = 0;
+    if (dict != NULL) {
+        // only the last LZ4_HISTORY bytes can be referenced
+        if (dict_len > LZ4_HISTORY) {
+            dict = (const char *)dict + dict_len - LZ4_HISTORY;
+            dict_len = LZ4_HISTORY;
+        }
+        LZ4_loadDict(l->stream, dict, dict_len);
+        memcpy(l->dec_dict, dict, dict_len);
+        l->dec_dict_len = dict_len;
+    }
+    return l;
+}
+
+static void lz4_end(void *state) {
+    struct lz4_state *l = state;
+    LZ4_freeStream(l->stream);
+    free(l);
+}
+
+static int lz4_compress(void *state, void *out, size_t out_size, const void *buf, size_t nbyte) {
+    struct lz4_state *l = state;
+    unsigned char *o = out;
+    o[0] = nbyte >> 24;
+    o[1] = nbyte >> 16;
+    o[2] = nbyte >> 8;
+    o[3] = nbyte;
+    int new_bytes = LZ4_compress_fast_continue(l->stream, buf, (char *)o + 4, nbyte,
+                                               out_size - 4, l->acceleration);
+    if (new_bytes <= 0) {
+        fprintf(stderr, "Error with LZ4_compress_fast_continue(): returned %d\n", new_bytes);
+        exit(1);
+    }
+    // keep the history before the caller reuses buf
+    LZ4_saveDict(l->stream, l->enc_dict, LZ4_HISTORY);
+    return 4 + new_bytes;
+}
+
+static int lz4_decompress(void *state, const void *buf, size_t nbyte, void *out, size_t out_size,
+                          void (*handle)(void *arg, char *buf, int nbyte), void *arg) {
+    struct lz4_state *l = state;
+    const unsigned char *b = buf;
+    (void) out;
+    (void) out_size;
+    if (nbyte < 4) {
+        return -1;
+    }
+    size_t len = (uint32_t)b[0] << 24 | b[1] << 16 | b[2] << 8 | b[3];
+    if (len > FRAME_MAX) {
+        return -1;
+    }
+    char *data = pool_get(len ? len : 1);
+    int new_bytes = LZ4_decompress_safe_usingDict((const char *)b + 4, data, nbyte - 4, len,
+                                                  l->dec_dict, l->dec_dict_len);
+    if (new_bytes < 0 || (size_t)new_bytes != len) {
+        fprintf(stderr, "Error with LZ4_decompress_safe_usingDict(): returned %d\n", new_bytes);
+        pool_put(data);
+        return -1;
+    }
+    // slide the history window
+    if (len >= LZ4_HISTORY) {
+        memcpy(l->dec_dict, data + len - LZ4_HISTORY, LZ4_HISTORY);
+        l->dec_dict_len = LZ4_HISTORY;
+    }
+    else {
+        int keep = l->dec_dict_len;
+        if (keep + len > LZ4_HISTORY) {
+            keep = LZ4_HISTORY - len;
+        }
+        memmove(l->dec_dict, l->dec_dict + l->dec_dict_len - keep, keep);
+        memcpy(l->dec_dict + keep, data, len);
+        l->dec_dict_len = keep + len;
+    }
+    if (len > 0) {
+        handle(arg, data, len);
+    }
+    pool_put(data);
+    return 0;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+// zstd codec
+// one streaming context per direction, flushed at the end of a message
+struct zstd_state {
+    ZSTD_CCtx *cctx;
+    ZSTD_DCtx *dctx;
+};
+
+static void *zstd_init(int level, const void *dict, size_t dict_len) {
+    struct zstd_state *zs = malloc(sizeof(struct zstd_state));
+    if (zs == NULL) {
+        fprintf(stderr, "Error allocating zstd state: %s\n", strerror(errno));
+        exit(1);
+    }
+    zs->cctx = ZSTD_createCCtx();
+    zs->dctx = ZSTD_createDCtx();
+    if (zs->cctx == NULL || zs->dctx == NULL) {
+        fprintf(stderr, "Error creating zstd contexts\n");
+        exit(1);
+    }
+    ZSTD_CCtx_setParameter(zs->cctx, ZSTD_c_compressionLevel, level ? level : 3);
+    // a 128 KiB window keeps idle sessions small
+    ZSTD_CCtx_setParameter(zs->cctx, ZSTD_c_windowLog, 17);
+    if (dict != NULL) {
+        ZSTD_CCtx_loadDictionary(zs->cctx, dict, dict_len);
+        ZSTD_DCtx_loadDictionary(zs->dctx, dict, dict_len);
+    }
+    return zs;
+}
+
+static void zstd_end(void *state) {
+    struct zstd_state *zs = state;
+    ZSTD_freeCCtx(zs->cctx);
+    ZSTD_freeDCtx(zs->dctx);
+    free(zs);
+}
+
+static int zstd_compress(void *state, void *out, size_t out_size, const void *buf, size_t nbyte) {
+    struct zstd_state *zs = state;
+    ZSTD_inBuffer in = {buf, nbyte, 0};
+    ZSTD_outBuffer o = {out, out_size, 0};
+    size_t remaining;
+    do {
+        remaining = ZSTD_compressStream2(zs->cctx, &o, &in, ZSTD_e_flush);
+        if (ZSTD_isError(remaining)) {
+            fprintf(stderr, "Error with ZSTD_compressStream2(): %s\n", ZSTD_getErrorName(remaining));
+            exit(1);
+        }
+        if (remaining != 0 && o.pos == o.size) {
+            fprintf(stderr, "Error with ZSTD_compressStream2(): output buffer too small\n");
+            exit(1);
+        }
+    } while (remaining != 0);
+    return o.pos;
+}
+
+static int zstd_decompress(void *state, const void *buf, size_t nbyte, void *out, size_t out_size,
+                           void (*handle)(void *arg, char *buf, int nbyte), void *arg) {
+    struct zstd_state *zs = state;
+    ZSTD_inBuffer in = {buf, nbyte, 0};
+    while (1) {
+        ZSTD_outBuffer o = {out, out_size, 0};
+        size_t ret = ZSTD_decompressStream(zs->dctx, &o, &in);
+        if (ZSTD_isError(ret)) {
+            fprintf(stderr, "Error with ZSTD_decompressStream(): %s\n", ZSTD_getErrorName(ret));
+            return -1;
+        }
+        if (o.pos > 0) {
+            handle(arg, out, o.pos);
+        }
+        if (in.pos == in.size && o.pos < o.size) {
+            return 0;
+        }
+    }
 }
+#endif
 
+// codecs
+struct codec_ops {
+    const char *name;
+    void *(*init)(int level, const void *dict, size_t dict_len);
+    void (*end)(void *state);
+    int (*compress)(void *state, void *out, size_t out_size, const void *buf, size_t nbyte);
+    int (*decompress)(void *state, const void *buf, size_t nbyte, void *out, size_t out_size,
+                      void (*handle)(void *arg, char *buf, int nbyte), void *arg);
+};
+
+// indexed by CODEC_*, codecs that are not built in have no init
+static const struct codec_ops codecs[CODEC_COUNT] = {
+    [CODEC_NONE] = {"none", NULL, NULL, NULL, NULL},
+    [CODEC_ZLIB] = {"zlib", zstate_init, zstate_end, zcompress_new, zdecompress},
+#ifdef HAVE_LZ4
+    [CODEC_LZ4] = {"lz4", lz4_init, lz4_end, lz4_compress, lz4_decompress},
+#else
+    [CODEC_LZ4] = {"lz4", NULL, NULL, NULL, NULL},
+#endif
+#ifdef HAVE_ZSTD
+    [CODEC_ZSTD] = {"zstd", zstd_init, zstd_end, zstd_compress, zstd_decompress},
+#else
+    [CODEC_ZSTD] = {"zstd", NULL, NULL, NULL, NULL},
+#endif
+};
+
+const char *codec_name(int id) {
+    return id >= 0 && id < CODEC_COUNT ? codecs[id].name : "unknown";
+}
+
+// bit (1 << id) for every codec built into this program
+uint8_t codec_mask(void) {
+    uint8_t mask = 1 << CODEC_NONE;
+    int id;
+    for (id = 1; id < CODEC_COUNT; id++) {
+        if (codecs[id].init != NULL) {
+            mask |= 1 << id;
+        }
+    }
+    return mask;
+}
+
+// parse the argument of --compress: <codec>[:<level>], or NULL for the
+// default (zlib). Returns -1 for an unknown or unavailable codec.
+int codec_parse(const char *arg, int *id, int *level) {
+    *id = CODEC_ZLIB;
+    *level = 0;
+    if (arg == NULL) {
+        return 0;
+    }
+    size_t len = strcspn(arg, ":");
+    for (*id = 1; *id < CODEC_COUNT; (*id)++) {
+        if (strlen(codecs[*id].name) == len && strncmp(arg, codecs[*id].name, len) == 0) {
+            break;
+        }
+    }
+    if (*id == CODEC_COUNT || codecs[*id].init == NULL) {
+        return -1;
+    }
+    if (arg[len] == ':') {
+        *level = atoi(arg + len + 1);
+    }
+    return 0;
+}
+
+// preset dictionary (option --dict), shared by all connections
+static unsigned char *dict_data;
+static size_t dict_len;
+static uint32_t dict_adler; // identifies it in the handshake, 0 for none
+
+// read the preset dictionary from path; only the last DICT_MAX bytes
+// are kept
+void dict_load(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "Error opening dictionary %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    // the end of a larger file is what the codecs can reach
+    if (fseek(f, 0, SEEK_END) == 0 && ftell(f) > DICT_MAX) {
+        fseek(f, -DICT_MAX, SEEK_END);
+    }
+    else {
+        rewind(f);
+    }
+    unsigned char *buf = malloc(DICT_MAX);
+    if (buf == NULL) {
+        fprintf(stderr, "Error allocating dictionary: %s\n", strerror(errno));
+        exit(1);
+    }
+    size_t len = fread(buf, 1, DICT_MAX, f);
+    fclose(f);
+    if (len == 0) {
+        fprintf(stderr, "Error with dictionary %s: empty\n", path);
+        exit(1);
+    }
+    dict_data = buf;
+    dict_len = len;
+    dict_adler = adler32(adler32(0, Z_NULL, 0), buf, len);
+    if (dict_adler == 0) {
+        dict_adler = 1;
+    }
+}
+
+uint32_t dict_id(void) {
+    return dict_adler;
+}
+
+// set up codec id for a connection, with the preset dictionary if
+// use_dict (both ends must agree on that, see codec_handshake())
+void codec_init(struct codec *c, int id, int level, int use_dict) {
+    c->id = id;
+    c->level = level;
+    c->ratio = 0;
+    c->skipped = 0;
+    c->min_size = use_dict ? CODEC_MIN_SIZE_DICT : CODEC_MIN_SIZE;
+    c->state = NULL;
+    if (codecs[id].init != NULL) {
+        c->state = use_dict ? codecs[id].init(level, dict_data, dict_len)
+                            : codecs[id].init(level, NULL, 0);
+    }
+}
+
+void codec_end(struct codec *c) {
+    if (codecs[c->id].end) {
+        codecs[c->id].end(c->state);
+    }
+    c->state = NULL;
+}
+
+// framing
+void frame_header(void *hdr, uint8_t flags, uint8_t codec, uint32_t len) {
+    unsigned char *h = hdr;
+    h[0] = FRAME_MAGIC;
+    h[1] = flags;
+    h[2] = codec;
+    h[3] = 0;
+    h[4] = len >> 24;
+    h[5] = len >> 16;
+    h[6] = len >> 8;
+    h[7] = len;
+}
+
+// whether the next bytes_read bytes are worth compressing: not when
+// they are tiny, nor while recent frames hardly shrank, except for a
+// probe every CODEC_PROBE frames to notice when the data changes
+static int codec_worth(struct codec *c, size_t bytes_read) {
+    if (c->id == CODEC_NONE || bytes_read < c->min_size) {
+        return 0;
+    }
+    if (c->ratio > CODEC_MAX_RATIO && ++c->skipped < CODEC_PROBE) {
+        return 0;
+    }
+    c->skipped = 0;
+    return 1;
+}
+
+// compress bytes_read bytes of buf with the codec into a single frame
+// at out, which has room for FRAME_BOUND(bytes_read) bytes. Payloads
+// that are not worth compressing (see codec_worth()) are sent as they
+// are in a frame without FRAME_COMPRESSED. Returns the frame size.
+int frame_compress(struct codec *c, void *out, void *buf, size_t bytes_read) {
+    unsigned char *frame = out;
+    if (!codec_worth(c, bytes_read)) {
+        memcpy(frame + FRAME_HDR_SIZE, buf, bytes_read);
+        frame_header(frame, 0, c->id, bytes_read);
+        return FRAME_HDR_SIZE + bytes_read;
+    }
+    int def_bytes = codecs[c->id].compress(c->state, frame + FRAME_HDR_SIZE,
+                                           CODEC_BOUND(bytes_read), buf, bytes_read);
+    frame_header(frame, FRAME_COMPRESSED, c->id, def_bytes);
+    // running average of compressed/original size, weight 1/8
+    int ratio = (uint64_t)def_bytes * CODEC_RATIO_ONE / bytes_read;
+    c->ratio += (ratio - c->ratio) / 8;
+    return FRAME_HDR_SIZE + def_bytes;
+}
+
+// put a frame made by frame_compress() or frame_winsize() on a channel
+// (HELLO_MUX)
+void frame_channel(void *frame, uint8_t channel) {
+    ((unsigned char *)frame)[3] = channel;
+}
+
+void frame_reader_init(struct frame_reader *r) {
+    r->buf = NULL;
+    r->cap = 0;
+    r->start = 0;
+    r->end = 0;
+}
+
+void frame_reader_free(struct frame_reader *r) {
+    pool_put(r->buf);
+    frame_reader_init(r);
+}
+
+// make room for at least need more bytes after r->end
+static void frame_reader_reserve(struct frame_reader *r, size_t need) {
+    // move the unread part to the front first
+    if (r->start > 0) {
+        memmove(r->buf, r->buf + r->start, r->end - r->start);
+        r->end -= r->start;
+        r->start = 0;
+    }
+    if (r->cap - r->end >= need) {
+        return;
+    }
+    unsigned char *buf = pool_get(r->end + need);
+    if (r->end > 0) {
+        memcpy(buf, r->buf, r->end);
+    }
+    pool_put(r->buf);
+    r->buf = buf;
+    r->cap = pool_size(buf);
+}
+
+// read once from fd into the reassembly buffer. Returns like read_peer():
+// bytes read, 0 on EOF, -1 with errno EAGAIN when there is nothing to read
+int frame_read(struct frame_reader *r, int fd, size_t buf_size, const char *msg) {
+    // a partially received frame gets room for all of it
+    size_t need = buf_size;
+    if (r->end - r->start >= FRAME_HDR_SIZE) {
+        unsigned char *h = r->buf + r->start;
+        size_t frame_len = FRAME_HDR_SIZE + ((uint32_t)h[4] << 24 | h[5] << 16 | h[6] << 8 | h[7]);
+        if (frame_len > r->end - r->start && frame_len - (r->end - r->start) > need) {
+            need = frame_len - (r->end - r->start);
+        }
+    }
+    frame_reader_reserve(r, need);
+    int rcount = read_peer(fd, r->buf + r->end, r->cap - r->end, msg);
+    if (rcount > 0) {
+        r->end += rcount;
+    }
+    return rcount;
+}
+
+// add nbyte bytes that did not come from frame_read() (a log, or what
+// another worker read) to the reassembly buffer
+void frame_reader_append(struct frame_reader *r, const void *buf, size_t nbyte) {
+    if (nbyte == 0) {
+        return;
+    }
+    frame_reader_reserve(r, nbyte);
+    memcpy(r->buf + r->end, buf, nbyte);
+    r->end += nbyte;
+}
+
+// take the next complete frame out of the reassembly buffer. f->payload
+// points into the buffer and stays valid until the next frame_read() or
+// frame_next(). Returns 1 for a frame, 0 if more bytes are needed and -1
+// if the stream is not made of valid frames.
+int frame_next(struct frame_reader *r, struct frame *f) {
+    size_t avail = r->end - r->start;
+    if (avail == 0 && r->buf != NULL) {
+        // all frames handled, give the buffer back until more arrives
+        frame_reader_free(r);
+    }
+    if (avail < FRAME_HDR_SIZE) {
+        return 0;
+    }
+    unsigned char *h = r->buf + r->start;
+    uint32_t len = (uint32_t)h[4] << 24 | h[5] << 16 | h[6] << 8 | h[7];
+    if (h[0] != FRAME_MAGIC || len > FRAME_MAX) {
+        fprintf(stderr, "Error with frame: bad header\n");
+        return -1;
+    }
+    if (avail < FRAME_HDR_SIZE + len) {
+        return 0;
+    }
+    f->flags = h[1];
+    f->codec = h[2];
+    f->channel = h[3];
+    f->len = len;
+    f->payload = h + FRAME_HDR_SIZE;
+    r->start += FRAME_HDR_SIZE + len;
+    if (r->start == r->end) {
+        r->start = r->end = 0;
+    }
+    return 1;
+}
+
+// pass the data of frame f to handle() in pieces of at most out_size
+// bytes, decompressing it first if it is compressed. Returns -1 if the
+// frame cannot be decoded.
+int frame_decode(struct codec *c, struct frame *f, void *out, size_t out_size,
+                 void (*handle)(void *arg, char *buf, int nbyte), void *arg) {
+    if (!(f->flags & FRAME_COMPRESSED)) {
+        if (f->len > 0) {
+            handle(arg, (char *)f->payload, f->len);
+        }
+        return 0;
+    }
+    if (f->codec != c->id || c->state == NULL) {
+        fprintf(stderr, "Error with frame: codec %d was not negotiated\n", f->codec);
+        return -1;
+    }
+    return codecs[c->id].decompress(c->state, f->payload, f->len, out, out_size, handle, arg);
+}
+
+// handshake
+// A framed connection starts with a HELLO control frame from the client:
+// its preferred codec in the header and, in the payload, the control
+// type, protocol version, level, the mask of codecs it has, the id of
+// its preset dictionary (0 for none) and HELLO_* flags. The server
+// answers with a HELLO carrying the codec, level, dictionary and flags
+// it agreed to.
+int frame_hello(void *out, int codec, int level, uint32_t dict, uint8_t flags) {
+    unsigned char *frame = out;
+    unsigned char *p = frame + FRAME_HDR_SIZE;
+    p[0] = CTRL_HELLO;
+    p[1] = PROTO_VERSION;
+    p[2] = (signed char)level;
+    p[3] = codec_mask();
+    p[4] = dict >> 24;
+    p[5] = dict >> 16;
+    p[6] = dict >> 8;
+    p[7] = dict;
+    p[8] = flags;
+    frame_header(frame, FRAME_CONTROL, codec, 9);
+    return FRAME_HDR_SIZE + 9;
+}
+
+// read codec, level, codec mask, dictionary id and flags from a HELLO
+// frame, -1 if f is not one
+int hello_parse(struct frame *f, int *codec, int *level, uint8_t *mask, uint32_t *dict,
+                uint8_t *flags) {
+    if (!(f->flags & FRAME_CONTROL) || f->len < 4 || f->payload[0] != CTRL_HELLO ||
+        f->codec >= CODEC_COUNT) {
+        return -1;
+    }
+    *codec = f->codec;
+    *level = (signed char)f->payload[2];
+    *mask = f->payload[3];
+    *dict = 0;
+    *flags = 0;
+    if (f->len >= 8) { // version 1 had no dictionary
+        unsigned char *p = f->payload;
+        *dict = (uint32_t)p[4] << 24 | p[5] << 16 | p[6] << 8 | p[7];
+    }
+    if (f->len >= 9) { // nor flags, like version 2
+        *flags = f->payload[8];
+    }
+    return 0;
+}
+
+// 8 bytes of v in network byte order at p, and back
+static void put_u64(unsigned char *p, uint64_t v) {
+    int i;
+    for (i = 0; i < 8; i++) {
+        p[i] = v >> (56 - 8 * i);
+    }
+}
+
+static uint64_t get_u64(const unsigned char *p) {
+    uint64_t v = 0;
+    int i;
+    for (i = 0; i < 8; i++) {
+        v = v << 8 | p[i];
+    }
+    return v;
+}
+
+// make the HELLO frame from frame_hello() at hello one that resumes the
+// session of token, offset data bytes after its start; returns the new
+// frame size
+int hello_resume(void *hello, const unsigned char *token, uint64_t offset) {
+    unsigned char *frame = hello;
+    unsigned char *p = frame + FRAME_HDR_SIZE;
+    p[8] |= HELLO_RESUME;
+    memcpy(p + 9, token, TOKEN_SIZE);
+    put_u64(p + 9 + TOKEN_SIZE, offset);
+    frame_header(frame, FRAME_CONTROL, frame[2], 9 + TOKEN_SIZE + 8);
+    return FRAME_HELLO_SIZE;
+}
+
+// read the token and offset of a HELLO with HELLO_RESUME, -1 if it has
+// none
+int hello_resume_parse(struct frame *f, unsigned char *token, uint64_t *offset) {
+    if (f->len < 9 + TOKEN_SIZE + 8 || !(f->payload[8] & HELLO_RESUME)) {
+        return -1;
+    }
+    memcpy(token, f->payload + 9, TOKEN_SIZE);
+    *offset = get_u64(f->payload + 9 + TOKEN_SIZE);
+    return 0;
+}
+
+// server side of the handshake: no compression unless both ends asked
+// for it, then the server's codec (from --compress) if the client has
+// it, else the client's choice if the server has it, else zlib.
+int codec_choose(int server_codec, int server_level, int client_codec, int client_level,
+                 uint8_t client_mask, int *level) {
+    if (server_codec == CODEC_NONE || client_codec == CODEC_NONE) {
+        *level = 0;
+        return CODEC_NONE;
+    }
+    if (client_mask & (1 << server_codec)) {
+        *level = server_level;
+        return server_codec;
+    }
+    if (codec_mask() & (1 << client_codec)) {
+        *level = client_level;
+        return client_codec;
+    }
+    *level = 0;
+    return client_mask & (1 << CODEC_ZLIB) ? CODEC_ZLIB : CODEC_NONE;
+}
+
+// read exactly one frame from a blocking fd into buf (buf_size bytes),
+// used for the handshake. Returns -1 on EOF or a bad frame.
+int frame_recv(int fd, struct frame *f, void *buf, size_t buf_size) {
+    unsigned char *b = buf;
+    size_t need = FRAME_HDR_SIZE, have = 0;
+    while (have < need) {
+        int rcount = read_peer(fd, b + have, need - have, "frame");
+        if (rcount <= 0) {
+            return -1;
+        }
+        have += rcount;
+        if (have == FRAME_HDR_SIZE) {
+            uint32_t len = (uint32_t)b[4] << 24 | b[5] << 16 | b[6] << 8 | b[7];
+            if (b[0] != FRAME_MAGIC || FRAME_HDR_SIZE + len > buf_size) {
+                return -1;
+            }
+            need += len;
+        }
+    }
+    f->flags = b[1];
+    f->codec = b[2];
+    f->channel = b[3];
+    f->len = need - FRAME_HDR_SIZE;
+    f->payload = b + FRAME_HDR_SIZE;
+    return 0;
+}
+
+// client side of the handshake on a blocking fd: offer codec
+// (CODEC_NONE without --compress), the preset dictionary and the
+// HELLO_* flags it wants, and set up c with what the server picked.
+// flags is set to those the server agreed to. Returns -1 if the server does not answer with a HELLO.
+// With token the HELLO asks to resume that session (see common.h).
+int codec_handshake(int fd, struct codec *c, int codec, int level, uint8_t *flags,
+                    const unsigned char *token, uint64_t offset) {
+    unsigned char hello[FRAME_HELLO_SIZE];
+    unsigned char reply[FRAME_HDR_SIZE + 64];
+    struct frame f;
+    int chosen, chosen_level;
+    uint8_t mask;
+    uint32_t dict;
+
+    int hello_bytes = frame_hello(hello, codec, level, dict_id(), *flags);
+    if (token != NULL) {
+        hello_bytes = hello_resume(hello, token, offset);
+    }
+    if (write_peer(fd, hello, hello_bytes, "hello") == -1) {
+        return -1;
+    }
+    if (frame_recv(fd, &f, reply, sizeof(reply)) == -1 ||
+        hello_parse(&f, &chosen, &chosen_level, &mask, &dict, flags) == -1 ||
+        !(codec_mask() & (1 << chosen))) {
+        fprintf(stderr, "Error with handshake: no HELLO from server\n");
+        return -1;
+    }
+    // the server only confirms a dictionary both ends have
+    codec_init(c, chosen, chosen_level, dict != 0 && dict == dict_id());
+    return 0;
+}
+
+// a CTRL_WINSIZE frame for a terminal of rows x cols
+int frame_winsize(void *out, int rows, int cols) {
+    unsigned char *frame = out;
+    unsigned char *p = frame + FRAME_HDR_SIZE;
+    p[0] = CTRL_WINSIZE;
+    p[1] = rows >> 8;
+    p[2] = rows;
+    p[3] = cols >> 8;
+    p[4] = cols;
+    frame_header(frame, FRAME_CONTROL, CODEC_NONE, 5);
+    return FRAME_HDR_SIZE + 5;
+}
+
+// read rows and cols from a CTRL_WINSIZE frame, -1 if f is not one
+int winsize_parse(struct frame *f, int *rows, int *cols) {
+    if (!(f->flags & FRAME_CONTROL) || f->len < 5 || f->payload[0] != CTRL_WINSIZE) {
+        return -1;
+    }
+    *rows = f->payload[1] << 8 | f->payload[2];
+    *cols = f->payload[3] << 8 | f->payload[4];
+    return 0;
+}
+
+// a CTRL_OPEN, CTRL_CLOSE or CTRL_WINDOW frame for channel, with value
+// (HELLO_* flags, unused, byte count) in the payload
+int frame_channel_ctrl(void *out, uint8_t channel, int type, uint32_t value) {
+    unsigned char *frame = out;
+    unsigned char *p = frame + FRAME_HDR_SIZE;
+    p[0] = type;
+    p[1] = value >> 24;
+    p[2] = value >> 16;
+    p[3] = value >> 8;
+    p[4] = value;
+    frame_header(frame, FRAME_CONTROL, CODEC_NONE, 5);
+    frame_channel(frame, channel);
+    return FRAME_HDR_SIZE + 5;
+}
+
+// the CTRL_* type of a channel control frame and its value, -1 if f is
+// not one
+int channel_ctrl_parse(struct frame *f, uint32_t *value) {
+    if (!(f->flags & FRAME_CONTROL) || f->len < 5 ||
+        (f->payload[0] != CTRL_OPEN && f->payload[0] != CTRL_CLOSE && f->payload[0] != CTRL_WINDOW)) {
+        return -1;
+    }
+    unsigned char *p = f->payload;
+    *value = (uint32_t)p[1] << 24 | p[2] << 16 | p[3] << 8 | p[4];
+    return p[0];
+}
+
+// a CTRL_TOKEN frame naming a detachable session, with the count of
+// data bytes sent before the ones that follow it
+int frame_token(void *out, const unsigned char *token, uint64_t seq) {
+    unsigned char *frame = out;
+    unsigned char *p = frame + FRAME_HDR_SIZE;
+    p[0] = CTRL_TOKEN;
+    memcpy(p + 1, token, TOKEN_SIZE);
+    put_u64(p + 1 + TOKEN_SIZE, seq);
+    frame_header(frame, FRAME_CONTROL, CODEC_NONE, 1 + TOKEN_SIZE + 8);
+    return FRAME_TOKEN_SIZE;
+}
+
+// read token and count from a CTRL_TOKEN frame, -1 if f is not one
+int token_parse(struct frame *f, unsigned char *token, uint64_t *seq) {
+    if (!(f->flags & FRAME_CONTROL) || f->len < 1 + TOKEN_SIZE + 8 || f->payload[0] != CTRL_TOKEN) {
+        return -1;
+    }
+    memcpy(token, f->payload + 1, TOKEN_SIZE);
+    *seq = get_u64(f->payload + 1 + TOKEN_SIZE);
+    return 0;
+}
+
+// asynchronous log
+// Records are copied into a ring buffer under a mutex (no I/O while it
+// is held) and written out by a background thread in as few write()s
+// as the ring allows.
+static uint64_t log_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+// copy nbyte bytes into the ring at l->head, wrapping around
+static void log_copy(struct logger *l, const void *buf, size_t nbyte) {
+    size_t at = l->head % l->cap;
+    size_t first = l->cap - at < nbyte ? l->cap - at : nbyte;
+    memcpy(l->ring + at, buf, first);
+    memcpy(l->ring, (const char *)buf + first, nbyte - first);
+    l->head += nbyte;
+}
+
+static void *log_writer(void *arg) {
+    struct logger *l = arg;
+    pthread_mutex_lock(&l->lock);
+    while (1) {
+        while (l->head == l->tail && !l->stop) {
+            pthread_cond_wait(&l->more, &l->lock);
+        }
+        if (l->head == l->tail) {
+            break; // stopped and drained
+        }
+        // everything queued up to the end of the ring in one write
+        size_t at = l->tail % l->cap;
+        size_t nbyte = l->head - l->tail;
+        if (nbyte > l->cap - at) {
+            nbyte = l->cap - at;
+        }
+        pthread_mutex_unlock(&l->lock);
+        ssize_t wcount = write(l->fd, l->ring + at, nbyte);
+        pthread_mutex_lock(&l->lock);
+        if (wcount == -1 && errno != EINTR) {
+            // a broken log must not take the session down
+            fprintf(stderr, "Error writing log: %s\n", strerror(errno));
+            l->tail = l->head;
+        }
+        else if (wcount > 0) {
+            l->tail += wcount;
+        }
+        pthread_cond_signal(&l->room);
+    }
+    pthread_mutex_unlock(&l->lock);
+    return NULL;
+}
+
+void log_open(struct logger *l, int fd, size_t cap, int format, int policy) {
+    l->fd = fd;
+    l->format = format;
+    l->policy = policy;
+    l->cap = cap;
+    l->head = l->tail = 0;
+    l->dropped = 0;
+    l->stop = 0;
+    l->ring = malloc(cap);
+    if (l->ring == NULL) {
+        fprintf(stderr, "Error allocating log buffer: %s\n", strerror(errno));
+        exit(1);
+    }
+    pthread_mutex_init(&l->lock, NULL);
+    pthread_cond_init(&l->more, NULL);
+    pthread_cond_init(&l->room, NULL);
+    // a binary log starts with its magic, unless appending to one; a
+    // pipe or FIFO is always a fresh stream
+    struct stat st;
+    if (format == LOG_BINARY && fstat(fd, &st) == 0 &&
+        (!S_ISREG(st.st_mode) || st.st_size == 0)) {
+        log_copy(l, LOG_MAGIC, LOG_MAGIC_SIZE);
+    }
+    int status = pthread_create(&l->thread, NULL, log_writer, l);
+    if (status != 0) {
+        fprintf(stderr, "Error starting log writer: %s\n", strerror(status));
+        exit(1);
+    }
+}
+
+// format a record header into hdr, returns its size
+static size_t log_header(struct logger *l, char *hdr, int dir, uint32_t session,
+                         uint64_t time_ns, size_t nbyte) {
+    if (l->format == LOG_TEXT) {
+        static const char *names[] = {"SENT", "RECEIVED", "DROPPED"};
+        return snprintf(hdr, LOG_HDR_MAX, "%s %zu bytes: ", names[dir], nbyte);
+    }
+    unsigned char *h = (unsigned char *)hdr;
+    int i;
+    for (i = 0; i < 8; i++) {
+        h[i] = time_ns >> (56 - 8 * i);
+    }
+    h[8] = nbyte >> 24;
+    h[9] = nbyte >> 16;
+    h[10] = nbyte >> 8;
+    h[11] = nbyte;
+    h[12] = dir;
+    h[13] = session >> 16;
+    h[14] = session >> 8;
+    h[15] = session;
+    return LOG_RECORD_HDR;
+}
+
+// queue one record of nbyte bytes sent or received (LOG_SENT or
+// LOG_RECEIVED) in session (0 outside the server). Never waits for the
+// disk; with LOG_DROP a record that does not fit is counted instead and
+// a LOG_DROPPED record with the count goes in front of the next one
+// that fits. A record too big to ever fit is split into pieces.
+void log_record(struct logger *l, int dir, uint32_t session, const void *buf, size_t nbyte) {
+    char hdr[LOG_HDR_MAX], drop_hdr[LOG_HDR_MAX];
+    size_t piece = l->cap / 2 - LOG_HDR_MAX - 1;
+    if (nbyte > piece) {
+        const char *p = buf;
+        size_t off;
+        for (off = 0; off < nbyte; off += piece) {
+            log_record(l, dir, session, p + off, nbyte - off < piece ? nbyte - off : piece);
+        }
+        return;
+    }
+    uint64_t time_ns = l->format == LOG_BINARY ? log_now_ns() : 0;
+    size_t hdr_len = log_header(l, hdr, dir, session, time_ns, nbyte);
+    size_t trailer = l->format == LOG_TEXT ? 1 : 0;
+    size_t need = hdr_len + nbyte + trailer;
+
+    pthread_mutex_lock(&l->lock);
+    char count[24];
+    size_t drop_len = 0, count_len = 0;
+    if (l->dropped > 0) {
+        count_len = snprintf(count, sizeof(count), "%llu", (unsigned long long)l->dropped);
+        drop_len = log_header(l, drop_hdr, LOG_DROPPED, session, time_ns, count_len) + count_len + trailer;
+    }
+    while (l->cap - (l->head - l->tail) < need + drop_len) {
+        if (l->policy == LOG_DROP) {
+            l->dropped++;
+            pthread_mutex_unlock(&l->lock);
+            return;
+        }
+        pthread_cond_wait(&l->room, &l->lock); // LOG_BLOCK
+    }
+    if (drop_len > 0) {
+        log_copy(l, drop_hdr, drop_len - count_len - trailer);
+        log_copy(l, count, count_len);
+        log_copy(l, "\n", trailer);
+        l->dropped = 0;
+    }
+    log_copy(l, hdr, hdr_len);
+    log_copy(l, buf, nbyte);
+    log_copy(l, "\n", trailer);
+    pthread_cond_signal(&l->more);
+    pthread_mutex_unlock(&l->lock);
+}
+
+// write out everything queued and stop the writer
+void log_close(struct logger *l) {
+    pthread_mutex_lock(&l->lock);
+    l->stop = 1;
+    pthread_cond_signal(&l->more);
+    pthread_mutex_unlock(&l->lock);
+    pthread_join(l->thread, NULL);
+    if (l->dropped > 0) {
+        fprintf(stderr, "Log: %llu records dropped\n", (unsigned long long)l->dropped);
+    }
+    free(l->ring);
+    l->ring = NULL;
+}
+
+// start a recording (option --record) into a new file at path
+void record_open(struct logger *l, const char *path) {
+    int fd = open(path, O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd == -1) {
+        fprintf(stderr, "Error creating recording %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    log_open(l, fd, RECORD_RING_SIZE, LOG_BINARY, LOG_DROP);
+}
@@ -1,6 +1,10 @@
 #ifndef COMMON_H
 #define COMMON_H
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // splice(), pipe2(), accept4()
+#endif
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -8,8 +12,19 @@
 #include <sys/wait.h>
 #include <errno.h>
 #include <string.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <pthread.h>
 
 #include <zlib.h>
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 
 // wrapper functions for system calls
 void close_wrap(int fd, int num);
@@ -17,8 +32,323 @@ void write_wrap(int fd, const void *buf, size_t nbyte, const char *msg);
 int read_wrap(int fd, void *buf, size_t nbyte, const char *msg);
 void dup_wrap(int fd, int num);
 
+// like read_wrap()/write_wrap(), but a lost peer (ECONNRESET, EPIPE) is
+// returned to the caller instead of ending the program. Both work on
+// non-blocking fds.
+int read_peer(int fd, void *buf, size_t nbyte, const char *msg);
+int write_peer(int fd, const void *buf, size_t nbyte, const char *msg);
+int splice_peer(int fd_in, int fd_out, size_t nbyte, const char *msg);
+void set_nonblock(int fd);
+
+// output queues
+// Bytes for a non-blocking fd that it did not take yet. outq_write()
+// writes what the fd takes now and queues the rest, outq_flush() writes
+// the queue on when the fd has room again (EPOLLOUT); both handle short
+// writes, EINTR and EAGAIN, and return -1 if the peer is gone (EPIPE,
+// ECONNRESET). outq_pending() is what is still waiting, with io_uring
+// the writes queued in the ring (they go there directly). Whoever fills
+// a queue stops producing above OUTQ_HIGH bytes and starts again once
+// it drained below OUTQ_LOW.
+#define OUTQ_HIGH (256 * 1024)
+#define OUTQ_LOW (64 * 1024)
+struct outq {
+    char *buf;
+    size_t start, end;
+};
+int outq_write(struct outq *q, int fd, const void *buf, size_t nbyte, const char *msg);
+int outq_flush(struct outq *q, int fd, const char *msg);
+size_t outq_pending(struct outq *q, int fd);
+void outq_free(struct outq *q);
+
+// address of a Unix socket (option --unix=<path>); a path starting
+// with '@' names a socket in the abstract namespace, which needs no
+// file and goes away with the server
+socklen_t unix_address(struct sockaddr_un *addr, const char *path);
+
+// buffer pool
+// reusable I/O buffers shared by all sessions of a thread, instead of
+// stack arrays
+void *pool_get(size_t size);
+void pool_put(void *buf);
+size_t pool_size(void *buf);
+
+// terminal stream scanning
+// Vectorized (SSE2/AVX2, scalar elsewhere) search for the bytes that
+// need special handling in the data between client, server and shell.
+#define SCAN_CR  0x01 // <cr>
+#define SCAN_LF  0x02 // <lf>
+#define SCAN_ETX 0x04 // ^C
+#define SCAN_EOT 0x08 // ^D
+size_t scan_special(const char *buf, size_t nbyte, int set);
+size_t translate_crlf(char *dst, const char *src, size_t nbyte, int set);
+void map_cr_lf(char *buf, size_t nbyte);
+
+// event loop
+// An epoll reactor: every fd is registered with a struct event whose
+// handler is called with the ready epoll events. Edge-triggered fds
+// (EPOLLET) must be read until read_peer() fails with EAGAIN.
+struct event {
+    int fd;
+    void (*handler)(struct event *ev, uint32_t events);
+    void *data;
+};
+int reactor_create(void);
+void reactor_add(int epfd, struct event *ev, uint32_t events);
+void reactor_del(int epfd, struct event *ev);
+int reactor_run(int epfd, int timeout);
+
+// io_uring backend (server option --io=uring)
+// reactor_uring() switches the reactor of epfd to io_uring (one per
+// thread), or returns -1 if the kernel cannot (the epoll path then
+// stays in use). Readiness still comes from epoll, but reactor_run()
+// waits for it with one io_uring_enter() that also submits every write
+// queued since the last pass. outq_write() then leaves its outq alone:
+// it copies the data into a registered buffer, or queues it in the
+// ring for the fd while that has a write in flight, waits for POLLOUT
+// or finds every buffer taken, and returns without waiting. Writes to
+// one fd complete in order, outq_pending() counts what the ring still
+// holds, and a failed write shows as -1 from the next outq_write() to
+// that fd.
+// reactor_drop() forgets what is queued for fd and cancels its write
+// or POLLOUT wait in flight, without waiting; close_wrap() calls it,
+// so output that must reach the peer has to drain (outq_pending() of
+// 0) before the fd is closed.
+int reactor_uring(int epfd);
+void reactor_drop(int fd);
+
+// statistics (server option --metrics)
+// The I/O wrappers above and reactor_run() count what they do in
+// io_stats. With io_stats.timing set reactor_run() also measures how
+// long each ready event waited behind the others of its batch.
+// Histograms have power-of-two buckets: bucket i counts durations up
+// to 1024 ns << i (about 1 us << i), the last one everything longer.
+#define HIST_BUCKETS 24
+struct histogram {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t bucket[HIST_BUCKETS];
+};
+
+struct io_stats {
+    uint64_t syscalls; // read, write, splice, poll, epoll_wait, ...
+    uint64_t wakeups;  // epoll_wait() calls that returned events
+    uint64_t events;   // handlers run
+    int timing;
+    struct histogram queue; // time from epoll_wait() to the handler
+};
+extern __thread struct io_stats io_stats; // per thread (server --workers)
+
+uint64_t now_ns(void);
+void histogram_add(struct histogram *h, uint64_t ns);
+void histogram_merge(struct histogram *into, const struct histogram *h);
+void histogram_print(FILE *out, const char *name, const char *labels, struct histogram *h);
+
 // compression and decompression
-int zcompress_new(void *tmp_buf, void *buf, size_t bytes_read, size_t buf_size);
-int zcompress(int fd, void *buf, size_t bytes_read, size_t buf_size);
-int zdecompress_old(void *buf, size_t bytes_read, size_t buf_size);
+// Codecs for option --compress=<codec>[:<level>]. zlib is always built
+// in, LZ4 and zstd with make LZ4=1 / ZSTD=1. A connection keeps one
+// codec state for its whole life: the compressor for sending and the
+// decompressor for receiving both stream across messages, each message
+// ending on a flush so the peer can decode all of it.
+#define CODEC_NONE 0
+#define CODEC_ZLIB 1
+#define CODEC_LZ4  2
+#define CODEC_ZSTD 3
+#define CODEC_COUNT 4
+// room needed for the compressed form of n bytes with any codec
+#define CODEC_BOUND(n) ((n) + ((n) >> 6) + 128)
+
+// Payloads below CODEC_MIN_SIZE bytes (keystrokes, prompts) are sent
+// uncompressed, they would only grow. Larger ones are compressed while
+// the running compressed/original ratio stays under CODEC_MAX_RATIO;
+// above it only every CODEC_PROBE-th frame is compressed to follow
+// the data. Skipped payloads stay out of the codec's history on both
+// ends, so the streams remain in step.
+#define CODEC_MIN_SIZE 64
+#define CODEC_MIN_SIZE_DICT 16  // with a preset dictionary short data shrinks too
+#define CODEC_RATIO_ONE 1024    // fixed point 1.0 for struct codec ratio
+#define CODEC_MAX_RATIO 922     // 0.9
+#define CODEC_PROBE 16
+
+struct codec {
+    int id;       // CODEC_*
+    int level;    // 0 for the codec's default
+    int ratio;    // running compressed/original size, CODEC_RATIO_ONE = 1
+    int skipped;  // frames sent uncompressed since the ratio got too high
+    size_t min_size; // CODEC_MIN_SIZE or CODEC_MIN_SIZE_DICT
+    void *state;  // codec specific, NULL for CODEC_NONE
+};
+
+const char *codec_name(int id);
+uint8_t codec_mask(void);
+int codec_parse(const char *arg, int *id, int *level);
+void codec_init(struct codec *c, int id, int level, int use_dict);
+
+// preset dictionary (option --dict=<file>), e.g. made by twoface-dict
+// from client logs. Connections use it when both ends loaded the same
+// one: deflateSetDictionary(), LZ4_loadDict() or a zstd raw-content
+// dictionary primes the history so even the first frames compress.
+#define DICT_MAX (64 * 1024)
+void dict_load(const char *path);
+uint32_t dict_id(void);
+void codec_end(struct codec *c);
+
+// framing (option --compress)
+// Compressed data is sent as frames so the receiver knows where each
+// message starts and ends however TCP splits or joins the bytes:
+//   byte 0     FRAME_MAGIC
+//   byte 1     flags (FRAME_COMPRESSED, FRAME_CONTROL)
+//   byte 2     codec of the payload (CODEC_*)
+//   byte 3     channel (HELLO_MUX), else 0
+//   bytes 4-7  payload length, network byte order
+// Every connection starts with a HELLO exchange that picks the codec.
+// When no compression was agreed both ends send plain bytes after it,
+// unless the session runs on a pty (HELLO_PTY): then frames also carry
+// CTRL_WINSIZE control messages.
+// With HELLO_MUX one connection carries up to CHANNEL_MAX channels,
+// each with its own shell; channel 0 is the one the connection starts
+// with. The client opens the others with CTRL_OPEN (payload: HELLO_PTY
+// or 0) on the new channel, the server confirms with a CTRL_OPEN of
+// what it granted. CTRL_CLOSE ends a channel, the server answers it or
+// sends it first when the shell exits; a channel number is only used
+// again after the server's CTRL_CLOSE. Every channel has flow control
+// in both directions: a sender may have CHANNEL_WINDOW data bytes
+// (before compression) outstanding, and the receiver hands out more
+// with CTRL_WINDOW (payload: the byte count) as it passes data on. All
+// channels share the connection's codec streams.
+// A client that asks for HELLO_DETACH (server option --detach) gets a
+// CTRL_TOKEN after the HELLO (payload: a TOKEN_SIZE token naming the
+// session, then the count of data bytes sent before the next one, 8
+// bytes in network byte order). The session then outlives its
+// connection: the shell keeps running and the end of its output is
+// kept. The client comes back with HELLO_RESUME and, after the flags
+// of its HELLO, the token and the count of data bytes it received. The
+// server's HELLO has HELLO_RESUME if it still had the session, then a
+// CTRL_TOKEN and the output the client missed, as far as it was kept.
+// A session whose shell exited ends with a CTRL_CLOSE on channel 0.
+// Clients that do not know the handshake send plain bytes from the
+// start; they never send FRAME_MAGIC first (keyboard input is 7-bit),
+// which is how the server tells them apart.
+#define FRAME_MAGIC 0xF7
+#define FRAME_HDR_SIZE 8
+#define FRAME_MAX (1 << 20)         // largest accepted payload
+#define FRAME_BURST (64 * 1024)     // most input the senders put in one frame
+#define FRAME_COMPRESSED 0x01
+#define FRAME_CONTROL 0x02          // payload starts with a CTRL_* type
+#define CTRL_HELLO 1
+#define CTRL_WINSIZE 2              // terminal size of the client (--pty)
+#define CTRL_OPEN 3                 // channels (HELLO_MUX), see above
+#define CTRL_CLOSE 4
+#define CTRL_WINDOW 5
+#define CTRL_TOKEN 6                // detachable sessions, see above
+#define PROTO_VERSION 5
+#define HELLO_PTY 0x01              // run the shell on a pseudo-terminal
+#define HELLO_MUX 0x02              // several channels on the connection
+#define HELLO_DETACH 0x04           // the session survives the connection
+#define HELLO_RESUME 0x08           // back to a detached session
+#define TOKEN_SIZE 16
+#define CHANNEL_MAX 256
+#define CHANNEL_WINDOW (256 * 1024)
+// room needed for a frame holding n compressed bytes of input
+#define FRAME_BOUND(n) (FRAME_HDR_SIZE + CODEC_BOUND(n))
+// room needed for a HELLO frame, resuming a session
+#define FRAME_HELLO_SIZE (FRAME_HDR_SIZE + 9 + TOKEN_SIZE + 8)
+// room needed for a CTRL_WINSIZE frame
+#define FRAME_WINSIZE_SIZE (FRAME_HDR_SIZE + 5)
+// room needed for a CTRL_OPEN, CTRL_CLOSE or CTRL_WINDOW frame
+#define FRAME_CHANNEL_SIZE (FRAME_HDR_SIZE + 5)
+// room needed for a CTRL_TOKEN frame
+#define FRAME_TOKEN_SIZE (FRAME_HDR_SIZE + 1 + TOKEN_SIZE + 8)
+
+struct frame {
+    uint8_t flags;
+    uint8_t codec;
+    uint8_t channel;
+    uint32_t len;
+    unsigned char *payload;
+};
+
+// incremental reassembly of received frames; bytes start..end of buf
+// are received but not yet returned by frame_next()
+struct frame_reader {
+    unsigned char *buf;
+    size_t cap;
+    size_t start;
+    size_t end;
+};
+
+void frame_header(void *hdr, uint8_t flags, uint8_t codec, uint32_t len);
+int frame_compress(struct codec *c, void *out, void *buf, size_t bytes_read);
+void frame_channel(void *frame, uint8_t channel);
+void frame_reader_init(struct frame_reader *r);
+void frame_reader_free(struct frame_reader *r);
+void frame_reader_append(struct frame_reader *r, const void *buf, size_t nbyte);
+int frame_read(struct frame_reader *r, int fd, size_t buf_size, const char *msg);
+int frame_next(struct frame_reader *r, struct frame *f);
+int frame_decode(struct codec *c, struct frame *f, void *out, size_t out_size,
+                 void (*handle)(void *arg, char *buf, int nbyte), void *arg);
+int frame_recv(int fd, struct frame *f, void *buf, size_t buf_size);
+
+// handshake
+int frame_hello(void *out, int codec, int level, uint32_t dict, uint8_t flags);
+int hello_parse(struct frame *f, int *codec, int *level, uint8_t *mask, uint32_t *dict,
+                uint8_t *flags);
+int codec_choose(int server_codec, int server_level, int client_codec, int client_level,
+                 uint8_t client_mask, int *level);
+int hello_resume(void *hello, const unsigned char *token, uint64_t offset);
+int hello_resume_parse(struct frame *f, unsigned char *token, uint64_t *offset);
+int codec_handshake(int fd, struct codec *c, int codec, int level, uint8_t *flags,
+                    const unsigned char *token, uint64_t offset);
+int frame_winsize(void *out, int rows, int cols);
+int winsize_parse(struct frame *f, int *rows, int *cols);
+int frame_channel_ctrl(void *out, uint8_t channel, int type, uint32_t value);
+int channel_ctrl_parse(struct frame *f, uint32_t *value);
+int frame_token(void *out, const unsigned char *token, uint64_t seq);
+int token_parse(struct frame *f, unsigned char *token, uint64_t *seq);
+
+// asynchronous log (client option --log, recordings with --record)
+// log_record() copies a record into a ring buffer and returns; a
+// writer thread drains the ring in batches. Text records are
+//   SENT <n> bytes: <n bytes>\n      (also RECEIVED, DROPPED)
+// binary ones (after LOG_MAGIC at the start of the file) are
+//   bytes 0-7   time in ns since the epoch, network byte order
+//   bytes 8-11  length, network byte order
+//   byte 12     LOG_SENT, LOG_RECEIVED or LOG_DROPPED
+//   bytes 13-15 session number (server --record), 0 otherwise
+// followed by the data. A LOG_DROPPED record holds the number of
+// records dropped before it, in decimal.
+// Recordings (--record) are binary logs of the data before compression,
+// LOG_SENT from client to server and LOG_RECEIVED back, whichever end
+// made them; twoface-bench --replay plays them back.
+#define LOG_SENT 0
+#define LOG_RECEIVED 1
+#define LOG_DROPPED 2
+#define LOG_TEXT 0
+#define LOG_BINARY 1
+#define LOG_DROP 0      // drop records while the ring is full
+#define LOG_BLOCK 1     // wait for the writer while the ring is full
+#define LOG_RING_SIZE (1 << 20)
+#define RECORD_RING_SIZE (16 << 20) // recordings also take bulk output
+#define LOG_MAGIC "TFLOG1\n\0"
+#define LOG_MAGIC_SIZE 8
+#define LOG_RECORD_HDR 16
+#define LOG_HDR_MAX 64
+
+struct logger {
+    int fd;
+    int format;     // LOG_TEXT or LOG_BINARY
+    int policy;     // LOG_DROP or LOG_BLOCK
+    unsigned char *ring;
+    size_t cap;
+    size_t head, tail; // bytes ever queued and written
+    uint64_t dropped;  // records not queued since the last DROPPED
+    int stop;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t more, room;
+};
+
+void log_open(struct logger *l, int fd, size_t cap, int format, int policy);
+void log_record(struct logger *l, int dir, uint32_t session, const void *buf, size_t nbyte);
+void log_close(struct logger *l);
+void record_open(struct logger *l, const char *path);
 #endif
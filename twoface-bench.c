@@ -0,0 +1,838 @@
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <signal.h>
+#include <string.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "common.h"
+// has wrapper functions for system calls
+// as well as functions for compression
+
+// Headless load driver for twoface-server. Starts the server in each
+// mode, talks the client protocol to it and reports keystroke
+// round-trip latency, bulk output throughput, CPU per MB and (with
+// --compress) the compression ratio.
+//
+// With --replay=<file> it plays back a recording (--record of the
+// client or server) instead: the recorded keyboard input is sent at
+// its recorded times (or flat out with --flat) and the recorded output
+// is produced by this program itself, started by the server as its
+// --shell with the TWOFACE_REPLAY* variables set. Every run of the
+// same recording pushes the same bytes through term_rw() and the
+// codecs.
+
+// getopt_long options
+static struct option longopts[] = {
+    {"server", required_argument, NULL, 's'},
+    {"port", required_argument, NULL, 'p'},
+    {"keys", required_argument, NULL, 'k'},
+    {"bulk", required_argument, NULL, 'b'},
+    {"bufsize", required_argument, NULL, 'z'},
+    {"compress", required_argument, NULL, 'c'},
+    {"replay", required_argument, NULL, 'r'},
+    {"session", required_argument, NULL, 'n'},
+    {"flat", no_argument, NULL, 'f'},
+    {"unix", required_argument, NULL, 'u'},
+    {"io", required_argument, NULL, 'i'},
+    {"stalled", required_argument, NULL, 't'},
+    { NULL, 0, NULL, 0}
+};
+
+static char * server_path = "./twoface-server";
+static int portnum = 5599;
+static char * unix_path = NULL; // option --unix, instead of TCP
+static char * io_arg = NULL;    // option --io, the server's I/O backend
+static int nkeys = 1000;                  // keystroke samples per mode
+static size_t bulk_bytes = 32 << 20;      // bulk output per mode
+static size_t buf_size = 256*2;           // passed on to the server
+static char * compress_arg = "zlib";      // codec of the --compress modes
+static int nstalled = 0;                  // connections that never read
+
+// a recording to play back (option --replay)
+struct record {
+    uint64_t at_ns; // since the first record of the session
+    int dir;        // LOG_SENT (keyboard) or LOG_RECEIVED (output)
+    size_t len;
+    char * data;
+};
+static char * replay_path = NULL;
+static uint32_t replay_session = 0;       // 0: the first one recorded
+static bool replay_flat = false;          // ignore the recorded times
+static struct record * records;
+static size_t nrecords;
+
+// one connection to the server, speaking the client protocol
+struct conn {
+    int fd;
+    bool compress;
+    struct codec codec;
+    struct frame_reader in;
+    char * inflate_buf;
+    // pending output (a whole frame must be written before the next)
+    char * out;
+    size_t out_len, out_off;
+    // counters
+    size_t wire_in, wire_out; // bytes on the socket
+    size_t data_in, data_out; // bytes before compression
+    size_t newlines_in;
+    char last_in;
+    bool eof_ok, eof; // the server may close the connection (replay)
+};
+
+// results of one mode
+struct result {
+    double p50, p90, p99, max; // microseconds
+    double mb_per_s;
+    double server_ms_per_mb, bench_ms_per_mb;
+    double ratio;
+};
+
+double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// CPU time (user + system) of process pid in ms, from /proc
+double proc_cpu_ms(pid_t pid) {
+    char path[64], stat[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return 0;
+    }
+    int n = read(fd, stat, sizeof(stat) - 1);
+    close(fd);
+    if (n <= 0) {
+        return 0;
+    }
+    stat[n] = '\0';
+    // fields after the command name, which is in parentheses
+    char * p = strrchr(stat, ')');
+    unsigned long utime, stime;
+    if (p == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                            &utime, &stime) != 2) {
+        return 0;
+    }
+    return (utime + stime) * 1000.0 / sysconf(_SC_CLK_TCK);
+}
+
+double self_cpu_ms() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec * 1e3 + ru.ru_utime.tv_usec / 1e3 +
+           ru.ru_stime.tv_sec * 1e3 + ru.ru_stime.tv_usec / 1e3;
+}
+
+// start twoface-server with the options of a mode
+pid_t server_start(const char * shell, bool compress) {
+    char port_opt[256], shell_opt[256], bufsize_opt[32], compress_opt[64], io_opt[32];
+    if (unix_path != NULL) {
+        snprintf(port_opt, sizeof(port_opt), "--unix=%s", unix_path);
+    }
+    else {
+        snprintf(port_opt, sizeof(port_opt), "--port=%d", portnum);
+    }
+    snprintf(bufsize_opt, sizeof(bufsize_opt), "--bufsize=%zu", buf_size);
+    char * args[7];
+    int n = 0;
+    args[n++] = server_path;
+    args[n++] = port_opt;
+    args[n++] = bufsize_opt;
+    if (shell != NULL) {
+        snprintf(shell_opt, sizeof(shell_opt), "--shell=%s", shell);
+        args[n++] = shell_opt;
+    }
+    if (compress) {
+        snprintf(compress_opt, sizeof(compress_opt), "--compress=%s", compress_arg);
+        args[n++] = compress_opt;
+    }
+    if (io_arg != NULL) {
+        snprintf(io_opt, sizeof(io_opt), "--io=%s", io_arg);
+        args[n++] = io_opt;
+    }
+    args[n] = NULL;
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        fprintf(stderr, "Error forking: %s\n", strerror(errno));
+        exit(1);
+    }
+    if (pid == 0) {
+        // keep the SHELL EXIT lines out of the report
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd != -1) {
+            dup2(null_fd, 2);
+        }
+        execv(server_path, args);
+        fprintf(stderr, "Error with execv (%s): %s\n", server_path, strerror(errno));
+        exit(1);
+    }
+    return pid;
+}
+
+void server_stop(pid_t pid) {
+    kill(pid, SIGTERM);
+    if (waitpid(pid, NULL, 0) == -1) {
+        fprintf(stderr, "Error with waitpid: %s\n", strerror(errno));
+        exit(1);
+    }
+}
+
+// connect to the server, retrying while it starts up. A sockbuf other
+// than 0 sets the socket's buffer sizes (before connecting, so that the
+// window matches).
+void conn_open(struct conn * c, bool compress, int sockbuf) {
+    memset(c, 0, sizeof(struct conn));
+    c->compress = compress;
+
+    struct sockaddr_in serv_addr;
+    bzero((char *)&serv_addr, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    serv_addr.sin_port = htons(portnum);
+    struct sockaddr_un unix_addr;
+    socklen_t unix_len = unix_path != NULL ? unix_address(&unix_addr, unix_path) : 0;
+
+    int tries;
+    for (tries = 0; ; tries++) {
+        c->fd = socket(unix_path != NULL ? AF_UNIX : AF_INET, SOCK_STREAM, 0);
+        if (c->fd == -1) {
+            fprintf(stderr, "Error creating socket: %s\n", strerror(errno));
+            exit(1);
+        }
+        if (sockbuf > 0) {
+            setsockopt(c->fd, SOL_SOCKET, SO_RCVBUF, &sockbuf, sizeof(sockbuf));
+            setsockopt(c->fd, SOL_SOCKET, SO_SNDBUF, &sockbuf, sizeof(sockbuf));
+        }
+        if (unix_path != NULL ? connect(c->fd, (struct sockaddr*)&unix_addr, unix_len) == 0 :
+            connect(c->fd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) == 0) {
+            break;
+        }
+        close(c->fd);
+        if (tries == 200) {
+            fprintf(stderr, "Error connecting to %s: %s\n", server_path, strerror(errno));
+            exit(1);
+        }
+        usleep(10000);
+    }
+    // keystrokes go out at once, like a terminal would send them
+    int on = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    int codec, level;
+    codec_parse(compress ? compress_arg : NULL, &codec, &level);
+    uint8_t flags = 0;
+    if (codec_handshake(c->fd, &c->codec, compress ? codec : CODEC_NONE, level, &flags, NULL, 0) == -1) {
+        exit(1);
+    }
+    set_nonblock(c->fd);
+
+    if (compress) {
+        frame_reader_init(&c->in);
+        c->inflate_buf = pool_get(FRAME_BURST);
+    }
+}
+
+void conn_close(struct conn * c) {
+    close_wrap(c->fd, 1);
+    if (c->compress) {
+        codec_end(&c->codec);
+        frame_reader_free(&c->in);
+        pool_put(c->inflate_buf);
+    }
+    pool_put(c->out);
+}
+
+// decoded bytes from the server
+void conn_data(void * arg, char * buf, int nbyte) {
+    struct conn * c = arg;
+    int i;
+    for (i = 0; i < nbyte; i++) {
+        if (buf[i] == '\n') {
+            c->newlines_in++;
+        }
+    }
+    c->data_in += nbyte;
+    c->last_in = buf[nbyte - 1];
+}
+
+// queue nbyte bytes for the server; only one message is pending at once
+void conn_queue(struct conn * c, const char * buf, size_t nbyte) {
+    c->data_out += nbyte;
+    pool_put(c->out);
+    if (c->compress) {
+        c->out = pool_get(FRAME_BOUND(nbyte));
+        c->out_len = frame_compress(&c->codec, c->out, (void *)buf, nbyte);
+    }
+    else {
+        c->out = pool_get(nbyte);
+        memcpy(c->out, buf, nbyte);
+        c->out_len = nbyte;
+    }
+    c->out_off = 0;
+}
+
+// write as much pending output as the socket takes
+void conn_flush(struct conn * c) {
+    while (c->out_off < c->out_len) {
+        ssize_t wcount = write(c->fd, c->out + c->out_off, c->out_len - c->out_off);
+        if (wcount == -1) {
+            if (errno == EAGAIN || errno == EINTR) {
+                return;
+            }
+            fprintf(stderr, "Error writing to server: %s\n", strerror(errno));
+            exit(1);
+        }
+        c->out_off += wcount;
+        c->wire_out += wcount;
+    }
+}
+
+// read everything the server has sent so far
+void conn_receive(struct conn * c) {
+    char buf[FRAME_BURST];
+    struct frame f;
+    while (1) {
+        int rcount;
+        if (c->compress) {
+            rcount = frame_read(&c->in, c->fd, FRAME_BURST, "from server");
+        }
+        else {
+            rcount = read_peer(c->fd, buf, sizeof(buf), "from server");
+        }
+        if (rcount == -1) {
+            return;
+        }
+        if (rcount == 0) {
+            if (c->eof_ok) {
+                c->eof = true;
+                return;
+            }
+            fprintf(stderr, "Error: server closed the connection\n");
+            exit(1);
+        }
+        c->wire_in += rcount;
+        if (!c->compress) {
+            conn_data(c, buf, rcount);
+            continue;
+        }
+        int status;
+        while ((status = frame_next(&c->in, &f)) == 1) {
+            if (frame_decode(&c->codec, &f, c->inflate_buf, FRAME_BURST, conn_data, c) == -1) {
+                status = -1;
+                break;
+            }
+        }
+        if (status == -1) {
+            fprintf(stderr, "Error: bad frame from server\n");
+            exit(1);
+        }
+    }
+}
+
+// wait up to timeout ms until the server sent something or there is
+// room to send. Returns false on timeout.
+bool conn_poll(struct conn * c, int timeout) {
+    struct pollfd pfd = {c->fd, POLLIN, 0};
+    if (c->out_off < c->out_len) {
+        pfd.events |= POLLOUT;
+    }
+    if (poll(&pfd, 1, timeout) == 0) {
+        return false;
+    }
+    if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+        conn_receive(c);
+    }
+    if (pfd.revents & POLLOUT) {
+        conn_flush(c);
+    }
+    return true;
+}
+
+// wait until the server sent something or there is room to send
+void conn_wait(struct conn * c) {
+    if (!conn_poll(c, 10000)) {
+        fprintf(stderr, "Error: no answer from server for 10 s\n");
+        exit(1);
+    }
+}
+
+int compare_double(const void * a, const void * b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// keystroke round trips. Without a shell the server echoes the key;
+// with one the key is a line for the shell that prints one newline.
+void bench_latency(struct conn * c, bool shell, struct result * r) {
+    double * samples = malloc(nkeys * sizeof(double));
+    if (samples == NULL) {
+        fprintf(stderr, "Error allocating samples: %s\n", strerror(errno));
+        exit(1);
+    }
+    const char * key = shell ? "echo\n" : "x";
+    int i;
+    for (i = 0; i < nkeys; i++) {
+        size_t data_in = c->data_in, newlines_in = c->newlines_in;
+        double start = now_us();
+        conn_queue(c, key, strlen(key));
+        conn_flush(c);
+        while (shell ? c->newlines_in == newlines_in : c->data_in == data_in) {
+            conn_wait(c);
+        }
+        samples[i] = now_us() - start;
+    }
+    qsort(samples, nkeys, sizeof(double), compare_double);
+    r->p50 = samples[nkeys * 50 / 100];
+    r->p90 = samples[nkeys * 90 / 100];
+    r->p99 = samples[nkeys * 99 / 100];
+    r->max = samples[nkeys - 1];
+    free(samples);
+}
+
+// bulk output. Without a shell bulk_bytes are sent and echoed back;
+// with one the shell prints bulk_bytes of numbers.
+void bench_bulk(struct conn * c, bool shell, pid_t server_pid, struct result * r) {
+    size_t data_in = c->data_in, wire_in = c->wire_in;
+    double server_cpu = proc_cpu_ms(server_pid);
+    double bench_cpu = self_cpu_ms();
+    double start = now_us();
+
+    if (shell) {
+        char cmd[128];
+        snprintf(cmd, sizeof(cmd), "seq 1 1000000000 | head -c %zu\n", bulk_bytes);
+        conn_queue(c, cmd, strlen(cmd));
+        conn_flush(c);
+        while (c->data_in - data_in < bulk_bytes) {
+            conn_wait(c);
+        }
+    }
+    else {
+        // lines of text, no ^D that would end the session
+        char * chunk = pool_get(buf_size);
+        size_t i;
+        for (i = 0; i < buf_size; i++) {
+            chunk[i] = (i % 64 == 63) ? '\n' : 'a' + (i * 7) % 26;
+        }
+        size_t sent = 0;
+        while (c->data_in - data_in < bulk_bytes) {
+            if (c->out_off == c->out_len && sent < bulk_bytes) {
+                size_t nbyte = bulk_bytes - sent < buf_size ? bulk_bytes - sent : buf_size;
+                conn_queue(c, chunk, nbyte);
+                sent += nbyte;
+                conn_flush(c);
+                continue;
+            }
+            conn_wait(c);
+        }
+        pool_put(chunk);
+    }
+
+    double elapsed = now_us() - start;
+    double mb = (c->data_in - data_in) / 1e6;
+    r->mb_per_s = mb / (elapsed / 1e6);
+    r->server_ms_per_mb = (proc_cpu_ms(server_pid) - server_cpu) / mb;
+    r->bench_ms_per_mb = (self_cpu_ms() - bench_cpu) / mb;
+    r->ratio = (double)(c->data_in - data_in) / (c->wire_in - wire_in);
+}
+
+// open nstalled connections (option --stalled) that make the server
+// produce output and never read it, so their queues fill up while the
+// mode is measured on another connection
+struct conn * stall_open(bool shell, bool compress) {
+    struct conn * stalled = calloc(nstalled ? nstalled : 1, sizeof(struct conn));
+    if (stalled == NULL) {
+        fprintf(stderr, "Error allocating connections: %s\n", strerror(errno));
+        exit(1);
+    }
+    // random letters, so that it fills the queues with --compress too
+    char * chunk = pool_get(FRAME_BURST);
+    size_t j;
+    for (j = 0; j < FRAME_BURST; j++) {
+        chunk[j] = (j % 64 == 63) ? '\n' : 'a' + rand() % 26;
+    }
+    int i;
+    for (i = 0; i < nstalled; i++) {
+        struct conn * c = &stalled[i];
+        conn_open(c, compress, 4096); // the server's queue fills sooner
+        if (shell) {
+            const char * cmd = "base64 /dev/urandom\n";
+            conn_queue(c, cmd, strlen(cmd));
+            conn_flush(c);
+            continue;
+        }
+        // echoed until the server stops reading it
+        struct pollfd pfd = {c->fd, POLLOUT, 0};
+        do {
+            if (c->out_off == c->out_len) {
+                conn_queue(c, chunk, FRAME_BURST);
+            }
+            conn_flush(c);
+        } while (c->out_off == c->out_len || poll(&pfd, 1, 100) == 1);
+    }
+    pool_put(chunk);
+    usleep(200000); // until the server has filled what it can
+    return stalled;
+}
+
+void stall_close(struct conn * stalled) {
+    int i;
+    for (i = 0; i < nstalled; i++) {
+        shutdown(stalled[i].fd, SHUT_RDWR);
+        conn_close(&stalled[i]);
+    }
+    free(stalled);
+}
+
+void bench_mode(const char * name, const char * shell, bool compress) {
+    struct conn c;
+    struct result r;
+    pid_t pid = server_start(shell, compress);
+    struct conn * stalled = stall_open(shell != NULL, compress);
+    conn_open(&c, compress, 0);
+
+    bench_latency(&c, shell != NULL, &r);
+    bench_bulk(&c, shell != NULL, pid, &r);
+
+    conn_close(&c);
+    stall_close(stalled);
+    server_stop(pid);
+
+    printf("%-16s %8.1f %8.1f %8.1f %8.1f %9.1f %9.2f %9.2f %7.2f\n", name,
+           r.p50, r.p90, r.p99, r.max, r.mb_per_s,
+           r.server_ms_per_mb, r.bench_ms_per_mb, r.ratio);
+    fflush(stdout);
+}
+
+// load the records of one session of a recording
+void replay_load(const char * path, uint32_t session) {
+    FILE * f = fopen(path, "rb");
+    char magic[LOG_MAGIC_SIZE];
+    if (f == NULL || fread(magic, 1, LOG_MAGIC_SIZE, f) != LOG_MAGIC_SIZE ||
+        memcmp(magic, LOG_MAGIC, LOG_MAGIC_SIZE) != 0) {
+        fprintf(stderr, "Error: %s is not a recording\n", path);
+        exit(1);
+    }
+    unsigned char h[LOG_RECORD_HDR];
+    uint64_t first = 0;
+    size_t cap = 0;
+    while (fread(h, 1, LOG_RECORD_HDR, f) == LOG_RECORD_HDR) {
+        uint64_t at = 0;
+        int i;
+        for (i = 0; i < 8; i++) {
+            at = at << 8 | h[i];
+        }
+        size_t len = (uint32_t)h[8] << 24 | h[9] << 16 | h[10] << 8 | h[11];
+        uint32_t id = h[13] << 16 | h[14] << 8 | h[15];
+        char * data = malloc(len ? len : 1);
+        if (data == NULL || fread(data, 1, len, f) != len) {
+            free(data);
+            break; // recording cut off
+        }
+        if (session == 0 && nrecords == 0) {
+            session = id;
+        }
+        if (id != session || h[12] == LOG_DROPPED || len == 0) {
+            free(data);
+            continue;
+        }
+        if (nrecords == cap) {
+            cap = cap ? 2 * cap : 1024;
+            records = realloc(records, cap * sizeof(struct record));
+            if (records == NULL) {
+                fprintf(stderr, "Error allocating records: %s\n", strerror(errno));
+                exit(1);
+            }
+        }
+        if (nrecords == 0) {
+            first = at;
+        }
+        records[nrecords].at_ns = at - first;
+        records[nrecords].dir = h[12];
+        records[nrecords].len = len;
+        records[nrecords].data = data;
+        nrecords++;
+    }
+    fclose(f);
+    if (nrecords == 0) {
+        fprintf(stderr, "Error: no records of session %u in %s\n", session, path);
+        exit(1);
+    }
+}
+
+// sleep until the recorded time of r (start in us), unless flat out
+void replay_until(double start, struct record * r) {
+    double wait = start + r->at_ns / 1e3 - now_us();
+    if (!replay_flat && wait > 0) {
+        usleep(wait);
+    }
+}
+
+// this program as the server's shell: write the recorded output at its
+// times while throwing the input away (it was recorded already)
+void replay_shell() {
+    replay_flat = getenv("TWOFACE_REPLAY_FLAT") != NULL;
+    replay_load(getenv("TWOFACE_REPLAY"), strtoul(getenv("TWOFACE_REPLAY_SESSION"), NULL, 10));
+    signal(SIGINT, SIG_IGN); // ^C in the recording
+    set_nonblock(0);
+    set_nonblock(1);
+    double start = now_us();
+    size_t i = 0, off = 0;
+    bool in_open = true;
+    char buf[FRAME_BURST];
+    while (i < nrecords || in_open) {
+        while (i < nrecords && records[i].dir != LOG_RECEIVED) {
+            i++;
+        }
+        struct pollfd pfd[2] = {{0, in_open ? POLLIN : 0, 0}, {1, 0, 0}};
+        int timeout = -1;
+        if (i < nrecords) {
+            double wait = start + records[i].at_ns / 1e3 - now_us();
+            if (replay_flat || wait <= 0) {
+                pfd[1].events = POLLOUT;
+            }
+            else {
+                timeout = wait / 1e3 + 1;
+            }
+        }
+        else if (!in_open) {
+            break;
+        }
+        if (poll(pfd, 2, timeout) == -1 && errno != EINTR) {
+            exit(1);
+        }
+        // keep draining the input so the server never waits on us
+        if (pfd[0].revents & (POLLIN | POLLHUP)) {
+            if (read(0, buf, sizeof(buf)) == 0) {
+                in_open = false;
+            }
+        }
+        if (pfd[1].revents & POLLOUT) {
+            ssize_t wcount = write(1, records[i].data + off, records[i].len - off);
+            if (wcount == -1 && errno != EAGAIN) {
+                exit(0); // the session is gone
+            }
+            if (wcount > 0 && (off += wcount) == records[i].len) {
+                i++;
+                off = 0;
+            }
+        }
+        if (pfd[1].revents & (POLLERR | POLLHUP)) {
+            exit(0);
+        }
+    }
+    exit(0);
+}
+
+// play the recording through a server started with --shell set to
+// this program: keyboard records go out at their times, output is
+// counted against the recording. Reports the time taken, output
+// throughput, CPU per MB, the ratio and how late output arrived
+// compared with the recording.
+void replay_mode(const char * name, const char * self, bool compress) {
+    struct conn c;
+    struct result r;
+    size_t i, expected = 0, nout = 0;
+    for (i = 0; i < nrecords; i++) {
+        if (records[i].dir == LOG_RECEIVED) {
+            expected += records[i].len;
+            nout++;
+        }
+    }
+    double * lag = malloc((nout ? nout : 1) * sizeof(double));
+    if (lag == NULL) {
+        fprintf(stderr, "Error allocating samples: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    pid_t pid = server_start(self, compress);
+    conn_open(&c, compress, 0);
+    c.eof_ok = true;
+    double server_cpu = proc_cpu_ms(pid);
+    double bench_cpu = self_cpu_ms();
+    double start = now_us();
+
+    size_t next_in = 0, next_out = 0, out_bytes = 0, nlag = 0;
+    while (!c.eof && (next_in < nrecords || c.data_in < expected)) {
+        // keyboard input due now
+        while (next_in < nrecords && records[next_in].dir != LOG_SENT) {
+            next_in++;
+        }
+        int timeout = 10000;
+        if (next_in < nrecords && c.out_off == c.out_len) {
+            double wait = start + records[next_in].at_ns / 1e3 - now_us();
+            if (replay_flat || wait <= 0) {
+                conn_queue(&c, records[next_in].data, records[next_in].len);
+                conn_flush(&c);
+                next_in++;
+                continue;
+            }
+            timeout = wait / 1e3 + 1;
+        }
+        if (!conn_poll(&c, timeout) && timeout == 10000) {
+            fprintf(stderr, "Error: no answer from server for 10 s\n");
+            exit(1);
+        }
+        // output records completed so far
+        while (next_out < nrecords &&
+               (records[next_out].dir != LOG_RECEIVED ||
+                c.data_in >= out_bytes + records[next_out].len)) {
+            if (records[next_out].dir == LOG_RECEIVED) {
+                out_bytes += records[next_out].len;
+                lag[nlag++] = now_us() - (start + records[next_out].at_ns / 1e3);
+            }
+            next_out++;
+        }
+    }
+    double elapsed = now_us() - start;
+    double mb = c.data_in / 1e6;
+    r.mb_per_s = mb / (elapsed / 1e6);
+    r.server_ms_per_mb = mb > 0 ? (proc_cpu_ms(pid) - server_cpu) / mb : 0;
+    r.bench_ms_per_mb = mb > 0 ? (self_cpu_ms() - bench_cpu) / mb : 0;
+    r.ratio = c.wire_in ? (double)c.data_in / c.wire_in : 0;
+    if (c.data_in != expected) {
+        fprintf(stderr, "%s: %zu of %zu output bytes arrived\n", name, c.data_in, expected);
+    }
+
+    conn_close(&c);
+    server_stop(pid);
+
+    // lag only means something at the recorded speed
+    qsort(lag, nlag, sizeof(double), compare_double);
+    if (replay_flat || nlag == 0) {
+        lag[0] = 0;
+        nlag = 1;
+    }
+    printf("%-17s %8.3f %10zu %10zu %9.1f %9.2f %9.2f %7.2f %9.1f %9.1f\n", name,
+           elapsed / 1e6, c.data_out, c.data_in, r.mb_per_s, r.server_ms_per_mb,
+           r.bench_ms_per_mb, r.ratio, lag[nlag / 2] / 1e3, lag[nlag * 99 / 100] / 1e3);
+    fflush(stdout);
+    free(lag);
+}
+
+// replay the recording plain and with --compress
+void replay(char * argv0) {
+    char self[4096];
+    ssize_t n = readlink("/proc/self/exe", self, sizeof(self) - 1);
+    if (n == -1) {
+        fprintf(stderr, "Error finding %s: %s\n", argv0, strerror(errno));
+        exit(1);
+    }
+    self[n] = '\0';
+    replay_load(replay_path, replay_session);
+
+    // for the copy of this program that the server starts as shell
+    char session[16];
+    snprintf(session, sizeof(session), "%u", replay_session);
+    setenv("TWOFACE_REPLAY", replay_path, 1);
+    setenv("TWOFACE_REPLAY_SESSION", session, 1);
+    if (replay_flat) {
+        setenv("TWOFACE_REPLAY_FLAT", "1", 1);
+    }
+
+    printf("replay of %s: %zu records over %.3f s%s, --bufsize=%zu, --compress=%s\n",
+           replay_path, nrecords, records[nrecords - 1].at_ns / 1e9,
+           replay_flat ? " (flat out)" : "", buf_size, compress_arg);
+    printf("%-17s %8s %10s %10s %9s %9s %9s %7s %9s %9s\n", "mode", "time s",
+           "keys B", "output B", "MB/s", "srv ms/MB", "cli ms/MB", "ratio",
+           "lag50 ms", "lag99 ms");
+    replay_mode("replay", self, false);
+    replay_mode("replay --compress", self, true);
+}
+
+/*
+ PROGRAM BEGINS
+ */
+int main(int argc, char * argv[]) {
+    int opt, codec, level;
+    // started by the server as the shell of a replay
+    if (getenv("TWOFACE_REPLAY") != NULL && getenv("TWOFACE_REPLAY_SESSION") != NULL) {
+        replay_shell();
+    }
+    while((opt = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
+        switch (opt) {
+            case 's':
+                server_path = optarg;
+                break;
+            case 'p':
+                portnum = atoi(optarg);
+                break;
+            case 'k':
+                nkeys = atoi(optarg);
+                break;
+            case 'b':
+                bulk_bytes = strtoul(optarg, NULL, 10);
+                break;
+            case 'z':
+                buf_size = strtoul(optarg, NULL, 10);
+                break;
+            case 'c':
+                compress_arg = optarg;
+                if (codec_parse(optarg, &codec, &level) == -1) {
+                    fprintf(stderr, "Error with --compress: unknown codec %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'r':
+                replay_path = optarg;
+                break;
+            case 'n':
+                replay_session = strtoul(optarg, NULL, 10);
+                break;
+            case 'f':
+                replay_flat = true;
+                break;
+            case 'u':
+                unix_path = optarg;
+                break;
+            case 'i':
+                io_arg = optarg;
+                break;
+            case 't':
+                nstalled = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: ./twoface-bench [--server=<path>] [--port=<num>] [--keys=<num>] [--bulk=<bytes>] [--bufsize=<bytes>] [--compress=<codec>[:<level>]] [--unix=<path>] [--io=epoll|uring] [--stalled=<num>] [--replay=<file> [--session=<num>] [--flat]]\n");
+                exit(1);
+        }
+    }
+    if (nkeys <= 0 || nstalled < 0 || bulk_bytes == 0 || buf_size == 0 || buf_size > FRAME_MAX) {
+        fprintf(stderr, "usage: ./twoface-bench [--server=<path>] [--port=<num>] [--keys=<num>] [--bulk=<bytes>] [--bufsize=<bytes>] [--compress=<codec>[:<level>]] [--unix=<path>] [--io=epoll|uring] [--stalled=<num>] [--replay=<file> [--session=<num>] [--flat]]\n");
+        exit(1);
+    }
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+        fprintf(stderr, "Error ignoring SIGPIPE: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    if (replay_path != NULL) {
+        replay(argv[0]);
+        exit(0);
+    }
+
+    printf("%d keystrokes, %zu bytes bulk output, --bufsize=%zu, --compress=%s, %s, --io=%s, "
+           "%d stalled readers\n",
+           nkeys, bulk_bytes, buf_size, compress_arg, unix_path != NULL ? "Unix socket" : "TCP",
+           io_arg != NULL ? io_arg : "epoll", nstalled);
+    printf("%-16s %8s %8s %8s %8s %9s %9s %9s %7s\n", "mode",
+           "p50 us", "p90 us", "p99 us", "max us", "MB/s", "srv ms/MB", "cli ms/MB", "ratio");
+    bench_mode("echo", NULL, false);
+    bench_mode("echo --compress", NULL, true);
+    bench_mode("shell", "/bin/sh", false);
+    bench_mode("shell --compress", "/bin/sh", true);
+    exit(0);
+}
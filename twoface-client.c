@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // accept4()
 #include <termios.h>
 #include <unistd.h>
 #include <sys/wait.h>
@@ -7,8 +8,12 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <stdbool.h>
-#include <poll.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/signalfd.h>
+#include <poll.h>
+#include <time.h>
 
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -22,21 +27,118 @@
 static int portnum, sockfd;
 static char * logname;
 
-// socket structs
-static struct sockaddr_in serv_addr;
-struct hostent * server;
+// server address
+static char * host = "localhost"; // option --host
+static int connect_timeout = 10;  // seconds, option --connect-timeout
+static char * unix_path = NULL; // option --unix, instead of TCP
+
+// Happy eyeballs (RFC 8305): the addresses of the host are tried in
+// turn, IPv6 and IPv4 alternating, a new attempt starting every
+// CONNECT_DELAY ms (or as soon as one fails) while the earlier ones
+// keep going. The first to connect wins.
+#define CONNECT_DELAY 250
+#define CONNECT_MAX 16 // addresses tried at most
 
-// log fd
+// log written by a background thread (option --log)
 static int log_fd;
+static struct logger logger;
+static int log_format = LOG_TEXT;   // option --log-format
+static int log_policy = LOG_DROP;   // option --log-policy
+
+// recording of the session before compression (option --record)
+static bool record_set = false;
+static struct logger recorder;
+
+// event loop with stdin and the server socket
+static int epfd;
+static struct event stdin_ev, server_ev, winch_ev;
+static bool log_set = false;
+static bool framed = false; // frames to and from the server
+static bool pty_set = false; // option --pty, the shell runs on a pty
+static int codec_id = CODEC_NONE; // option --compress[=<codec>[:<level>]]
+static int codec_level = 0;
+static bool done = false;
+static size_t buf_size = 256*2; // bytes per read, option --bufsize
+
+// output for the display, gathered during one pass of the event loop
+// and written with a single write by display_flush()
+#define DISPLAY_FLUSH (64 * 1024) // flush early past this many bytes
+static char * display_buf;
+static size_t display_len, display_cap;
+
+// codec agreed on with the server and reassembly of the frames it
+// sends (option --compress)
+static struct codec codec;
+static struct frame_reader in;
+
+// Several terminals on one connection (option --mux=<path>): the first
+// client started with a path connects to the server with HELLO_MUX and
+// listens on a Unix socket there. Clients started later with the same
+// path connect to it instead of the server and talk to it as they would
+// to the server, without compression; each gets a channel of the first
+// client's connection (see common.h) with its own shell. Channel 0 is
+// the first client's own terminal. Output for the others is queued
+// while their socket is full and the server is only given credit once
+// it is written, so a terminal that is not read holds up nothing but
+// its own channel.
+#define CHAN_FREE 0
+#define CHAN_HELLO 1   // waiting for the HELLO of the local client
+#define CHAN_OPENING 2 // CTRL_OPEN sent, waiting for the server's
+#define CHAN_OPEN 3
+#define CHAN_CLOSING 4 // CTRL_CLOSE sent, waiting for the server's
+struct channel {
+    struct event ev; // connection of the local client (channel 0: stdin_ev)
+    int state;       // CHAN_*
+    bool paused;     // input waits for CTRL_WINDOW (or CTRL_OPEN)
+    bool framed;     // frames to and from the local client (HELLO_PTY)
+    struct frame_reader in;
+    char * out;      // output not yet written to the local client
+    size_t out_len, out_off, out_data; // out_data: data bytes in it
+    int64_t window;   // data bytes the server still takes
+    uint32_t unacked; // data bytes passed on since the last CTRL_WINDOW
+};
+static char * mux_path = NULL;
+static bool mux_on = false; // HELLO_MUX agreed
+
+// output the server socket did not take yet; above OUTQ_HIGH neither
+// the keyboard nor the --mux clients are read until it drained below
+// OUTQ_LOW, so the client keeps showing output while the server is
+// behind
+static struct outq to_server;
+static bool input_paused = false;
+static bool stdin_watched = true;
+static struct event mux_ev;
+static struct channel channels[CHANNEL_MAX];
 
-// fd[0] is for stdin and fd[1] is for server
-static struct pollfd fds[2];
+// Detachable session (option --detach[=<file>]): when the connection
+// drops the server keeps the shell, and the client connects again for
+// up to connect_timeout seconds and resumes the session with its token,
+// getting the output it missed (see common.h). With a file the token is
+// also kept there, so a later client resumes the session as well.
+static bool detach_set = false;
+static char * token_path = NULL;
+static bool token_set = false;
+static unsigned char token[TOKEN_SIZE];
+static uint64_t data_received; // from the server so far
+static bool session_over = false; // CTRL_CLOSE, the shell exited
+static bool reconnect = false; // the connection was lost
 
 // getopt_long options
 static struct option longopts[] = {
     {"port", required_argument, NULL, 'p'},
     {"log", required_argument, NULL, 'l'},
-    {"compress", no_argument, NULL, 'c'},
+    {"log-format", required_argument, NULL, 'f'},
+    {"log-policy", required_argument, NULL, 'o'},
+    {"record", required_argument, NULL, 'r'},
+    {"compress", optional_argument, NULL, 'c'},
+    {"bufsize", required_argument, NULL, 'b'},
+    {"dict", required_argument, NULL, 'd'},
+    {"pty", no_argument, NULL, 't'},
+    {"unix", required_argument, NULL, 'u'},
+    {"host", required_argument, NULL, 'h'},
+    {"connect-timeout", required_argument, NULL, 'T'},
+    {"mux", required_argument, NULL, 'm'},
+    {"detach", optional_argument, NULL, 'D'},
     { NULL, 0, NULL, 0}
 };
 
@@ -78,163 +180,939 @@ void term_adjust () {
     }
 }
 
-void client_socket() {
-    // socket code mostly derived from the following tutorial
-    // by Robert Ingalls:
-    // http://www.cs.rpi.edu/~moorthy/Courses/os98/Pgms/socket.html
-    
-    // create new socket
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
+// connect to a server on the same host through its --unix socket,
+// false if it is not there
+bool unix_socket() {
+    struct sockaddr_un addr;
+    socklen_t len = unix_address(&addr, unix_path);
+    sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
     if (sockfd == -1) {
         fprintf(stderr, "Error creating socket: %s\n", strerror(errno));
         exit(1);
     }
-    
-    // get network host entry
-    server = gethostbyname("localhost");
-    if (server == NULL) {
-        fprintf(stderr, "Error getting host by name: %s\n", hstrerror(h_errno));
+    if (connect(sockfd, (struct sockaddr *)&addr, len) == -1) {
+        fprintf(stderr, "Error connecting to %s: %s\n", unix_path, strerror(errno));
+        close_wrap(sockfd, 33);
+        sockfd = -1;
+        return false;
+    }
+    return true;
+}
+
+// connect to the client that listens on --mux path, false if there is
+// none (yet)
+bool mux_join() {
+    struct sockaddr_un addr;
+    socklen_t len = unix_address(&addr, mux_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        fprintf(stderr, "Error creating socket: %s\n", strerror(errno));
         exit(1);
     }
-    
-    // set fields in serv_addr
-    bzero((char *) &serv_addr, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    bcopy((char *)server->h_addr,
-          (char *)&serv_addr.sin_addr.s_addr,
-          server->h_length);
-    serv_addr.sin_port = htons(portnum);
-    
-    // connect to server
-    if (connect(sockfd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
-        fprintf(stderr, "Error initiating connection on socket: %s\n", strerror(errno));
+    if (connect(fd, (struct sockaddr *)&addr, len) == -1) {
+        close_wrap(fd, 30);
+        return false;
+    }
+    sockfd = fd;
+    return true;
+}
+
+static long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+// connect to the server at --host and --port, racing its addresses
+// (see CONNECT_DELAY) for at most connect_timeout seconds. false if
+// none answered.
+bool client_socket() {
+    struct addrinfo hints, * res, * ai;
+    char port[16];
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port, sizeof(port), "%d", portnum);
+    int err = getaddrinfo(host, port, &hints, &res);
+    if (err != 0) {
+        fprintf(stderr, "Error resolving %s: %s\n", host, gai_strerror(err));
+        return false;
+    }
+
+    // the resolver's order, but families alternating from the first
+    struct addrinfo * addrs[CONNECT_MAX];
+    int naddrs = 0, taken[CONNECT_MAX] = {0};
+    struct addrinfo * sorted[CONNECT_MAX];
+    for (ai = res; ai != NULL && naddrs < CONNECT_MAX; ai = ai->ai_next) {
+        addrs[naddrs++] = ai;
+    }
+    int i, n, family = addrs[0]->ai_family;
+    for (n = 0; n < naddrs; n++) {
+        for (i = 0; i < naddrs && (taken[i] || addrs[i]->ai_family != family); i++);
+        if (i == naddrs) {
+            for (i = 0; taken[i]; i++); // none of this family left
+        }
+        taken[i] = 1;
+        sorted[n] = addrs[i];
+        family = addrs[i]->ai_family == AF_INET6 ? AF_INET : AF_INET6;
+    }
+
+    struct pollfd pending[CONNECT_MAX];
+    int npending = 0, next = 0, last_err = ETIMEDOUT;
+    long deadline = now_ms() + connect_timeout * 1000L;
+    long next_start = 0;
+    sockfd = -1;
+    while (sockfd == -1) {
+        long now = now_ms();
+        if (now >= deadline) {
+            break;
+        }
+        // start the next attempt when due or when nothing is pending
+        if (next < naddrs && (now >= next_start || npending == 0)) {
+            ai = sorted[next++];
+            int fd = socket(ai->ai_family, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+            if (fd == -1) {
+                last_err = errno;
+                continue;
+            }
+            if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+                sockfd = fd;
+                break;
+            }
+            if (errno != EINPROGRESS) {
+                last_err = errno;
+                close(fd);
+                continue;
+            }
+            pending[npending].fd = fd;
+            pending[npending].events = POLLOUT;
+            npending++;
+            next_start = now + CONNECT_DELAY;
+        }
+        if (npending == 0) {
+            if (next == naddrs) {
+                break; // every address failed
+            }
+            continue;
+        }
+        long wait = deadline - now;
+        if (next < naddrs && next_start - now < wait) {
+            wait = next_start - now;
+        }
+        if (poll(pending, npending, wait > 0 ? wait : 0) == -1 && errno != EINTR) {
+            fprintf(stderr, "Error polling connections: %s\n", strerror(errno));
+            exit(1);
+        }
+        for (i = 0; i < npending; i++) {
+            if (pending[i].revents == 0) {
+                continue;
+            }
+            int so_error = 0;
+            socklen_t len = sizeof(so_error);
+            getsockopt(pending[i].fd, SOL_SOCKET, SO_ERROR, &so_error, &len);
+            if (so_error == 0 && sockfd == -1) {
+                sockfd = pending[i].fd;
+            }
+            else {
+                if (so_error != 0) {
+                    last_err = so_error;
+                }
+                close(pending[i].fd);
+            }
+            pending[i--] = pending[--npending];
+        }
+    }
+    // the losers of the race
+    for (i = 0; i < npending; i++) {
+        close(pending[i].fd);
+    }
+    freeaddrinfo(res);
+    if (sockfd == -1) {
+        fprintf(stderr, "Error connecting to %s port %d: %s\n", host, portnum, strerror(last_err));
+        return false;
+    }
+    // the handshake and session code expect a blocking socket
+    int flags = fcntl(sockfd, F_GETFL);
+    if (flags == -1 || fcntl(sockfd, F_SETFL, flags & ~O_NONBLOCK) == -1) {
+        fprintf(stderr, "Error clearing O_NONBLOCK: %s\n", strerror(errno));
         exit(1);
     }
+    return true;
+}
+
+// make room for nbyte more bytes of display output
+char * display_reserve (size_t nbyte) {
+    if (display_len + nbyte > display_cap) {
+        size_t cap = display_cap ? display_cap : 4096;
+        while (cap < display_len + nbyte) {
+            cap *= 2;
+        }
+        display_buf = realloc(display_buf, cap);
+        if (display_buf == NULL) {
+            fprintf(stderr, "Error allocating display buffer: %s\n", strerror(errno));
+            exit(1);
+        }
+        display_cap = cap;
+    }
+    return display_buf + display_len;
 }
 
+void display_flush () {
+    if (display_len > 0) {
+        write_wrap(1, display_buf, display_len, "to display");
+        display_len = 0;
+    }
+}
+
+// queue log records; the relay never waits for the log file
 void log_sent (char * log_str_sent, int bytes_sent) {
-    dprintf(log_fd, "SENT %d bytes: ", bytes_sent);
-    write(log_fd, log_str_sent, bytes_sent);
-    write(log_fd, "\n", 1);
+    log_record(&logger, LOG_SENT, 0, log_str_sent, bytes_sent);
 }
 
 void log_received (char * log_str_receive, int bytes_received) {
-    dprintf(log_fd, "RECEIVED %d bytes: ", bytes_received);
-    write(log_fd, log_str_receive, bytes_received);
-    write(log_fd, "\n", 1);
+    log_record(&logger, LOG_RECEIVED, 0, log_str_receive, bytes_received);
 }
 
-// reading and writing
-void term_rw (bool log_set, bool compress_set) {
-    size_t buf_size = 256*2;
-    char buf_to[buf_size];
-    char buf_from[buf_size];
-    char cr_lf[] = {0x0D, 0x0A};
-    int rcount_stdin, rcount_server;
-    
-    int def_bytes = 0;
-    char tmp_buf[buf_size];
-    while(1){
-        // POLL
-        if (poll(fds, 2, 0) == -1) {
-            fprintf(stderr, "Error polling: %s\n", strerror(errno));
-            exit(1);
+void local_event(struct event * ev, uint32_t events);
+
+// stdin is in the event loop unless its channel or the queue to the
+// server is full
+void stdin_update() {
+    bool watch = !channels[0].paused && !input_paused;
+    if (watch != stdin_watched) {
+        if (watch) {
+            reactor_add(epfd, &stdin_ev, EPOLLIN);
         }
-        
-        // READ from keyboard
-        rcount_stdin = -1;
-        if (fds[0].revents & POLLIN) {
-            rcount_stdin = read_wrap(0, buf_to, buf_size, "from stdin [1]");
+        else {
+            reactor_del(epfd, &stdin_ev);
         }
-        
-        // READ from server
-        rcount_server = -1;
-        if (fds[1].revents & POLLIN) {
-            rcount_server = read_wrap(sockfd, buf_from, buf_size, "from server [1]");
+        stdin_watched = watch;
+    }
+}
+
+// stop and restart reading the input of channel ch while the server's
+// window for it is used up. stdin (channel 0) leaves the event loop;
+// local clients are edge-triggered, so what came meanwhile is read on
+// resume.
+void channel_pause(struct channel * ch) {
+    if (!ch->paused) {
+        ch->paused = true;
+        if (ch == &channels[0]) {
+            stdin_update();
         }
-        
-        // LOG received bytes
-        if (log_set && rcount_server > 0) {
-            log_received(buf_from, rcount_server);
+    }
+}
+
+void channel_resume(struct channel * ch) {
+    if (ch->paused) {
+        ch->paused = false;
+        if (ch == &channels[0]) {
+            stdin_update();
         }
-        
-        // decompress
-        
-        if (compress_set) {
-            if (rcount_server > 0) {
-                rcount_server = zdecompress_old(buf_from, rcount_server, buf_size);
-            }
+        else {
+            local_event(&ch->ev, EPOLLIN);
         }
-        
-        // WRITE stdin to...
-        char c;
+    }
+}
+
+// the connection to the server failed or was closed: a detachable
+// session is resumed on a new one after this pass of the event loop
+void server_lost() {
+    if (detach_set && !session_over) {
+        reconnect = true;
+    }
+    else {
+        done = true;
+    }
+}
+
+// write to the server, queueing what the socket does not take
+void server_write(const void * buf, size_t nbyte) {
+    if (reconnect) {
+        return;
+    }
+    if (outq_write(&to_server, server_ev.fd, buf, nbyte, "to server") == -1) {
+        server_lost();
+        return;
+    }
+    if (!input_paused && outq_pending(&to_server, server_ev.fd) >= OUTQ_HIGH) {
+        input_paused = true;
+        stdin_update();
+    }
+}
+
+// the server socket has room again: write the queue on, and read the
+// input again once it drained
+void server_drained() {
+    if (reconnect) {
+        return;
+    }
+    if (outq_flush(&to_server, server_ev.fd, "to server") == -1) {
+        server_lost();
+        return;
+    }
+    if (input_paused && outq_pending(&to_server, server_ev.fd) < OUTQ_LOW) {
+        input_paused = false;
+        stdin_update();
         int i;
-        for (i = 0; i < rcount_stdin; i++) {
-            c = buf_to[i];
-            // ...stdout
-            switch (c) {
-                case 0x0D: // <cr>
-                case 0x0A: // <lf>
-                    write_wrap(1, cr_lf, 2, "to display [1]");
-                    break;
-                default:
-                    write_wrap(1, &c, 1, "to display [1]");
+        for (i = 1; i < CHANNEL_MAX && !input_paused; i++) {
+            if (channels[i].state == CHAN_OPEN && !channels[i].paused) {
+                local_event(&channels[i].ev, EPOLLIN);
+            }
+        }
+    }
+}
+
+// send a CTRL_OPEN, CTRL_CLOSE or CTRL_WINDOW for channel ch
+void mux_send(struct channel * ch, int type, uint32_t value) {
+    unsigned char frame[FRAME_CHANNEL_SIZE];
+    server_write(frame, frame_channel_ctrl(frame, ch - channels, type, value));
+}
+
+// nbyte bytes of channel ch went on to their terminal: the server may
+// send as much again
+void mux_credit(struct channel * ch, int nbyte) {
+    if (!mux_on) {
+        return;
+    }
+    ch->unacked += nbyte;
+    if (ch->unacked >= CHANNEL_WINDOW / 2) {
+        mux_send(ch, CTRL_WINDOW, ch->unacked);
+        ch->unacked = 0;
+    }
+}
+
+// keyboard input is ready (level-triggered, stdin shares its file
+// description with stdout so it stays blocking): one read per wakeup
+void stdin_event(struct event * ev, uint32_t events) {
+    int rcount_stdin;
+    int def_bytes = 0;
+
+    // terminal went away
+    if (!(events & EPOLLIN) && events & (EPOLLHUP | EPOLLERR)) {
+        done = true;
+        return;
+    }
+
+    // READ from keyboard
+    char * buf_to = pool_get(buf_size);
+    rcount_stdin = read_wrap(ev->fd, buf_to, buf_size, "from stdin [1]");
+
+    // SHUTDOWN
+    if (rcount_stdin == 0) {
+        pool_put(buf_to);
+        done = true;
+        return;
+    }
+
+    // WRITE stdin to...
+    // ...stdout, <cr> and <lf> both as <cr><lf>
+    // (with --pty the remote terminal echoes and maps <cr> itself)
+    if (!pty_set) {
+        char * out = display_reserve(2 * rcount_stdin);
+        display_len += translate_crlf(out, buf_to, rcount_stdin, SCAN_CR | SCAN_LF);
+        // ...and convert <cr> for write to server
+        map_cr_lf(buf_to, rcount_stdin);
+    }
+    if (record_set) {
+        log_record(&recorder, LOG_SENT, 0, buf_to, rcount_stdin);
+    }
+
+    //WRITE stdin to server
+    char * tmp_buf = NULL;
+    if (framed) {
+        tmp_buf = pool_get(FRAME_BOUND(rcount_stdin));
+        def_bytes = frame_compress(&codec, tmp_buf, buf_to, rcount_stdin);
+        server_write(tmp_buf, def_bytes);
+    }
+    else {
+        server_write(buf_to, rcount_stdin);
+    }
+
+    // LOGGING bytes written to server
+    if (log_set) {
+        if (framed && def_bytes > 0) {
+            log_sent(tmp_buf, def_bytes);
+        }
+        else {
+            log_sent(buf_to, rcount_stdin);
+        }
+    }
+    pool_put(tmp_buf);
+    pool_put(buf_to);
+
+    // with --mux the keyboard waits while the server is behind
+    if (mux_on) {
+        channels[0].window -= rcount_stdin;
+        if (channels[0].window <= 0) {
+            channel_pause(&channels[0]);
+        }
+    }
+}
+
+//WRITE server read to stdout
+// (gathered in the display buffer, see display_flush())
+void display (void * arg, char * buf_from, int rcount_server) {
+    (void) arg;
+    if (record_set) {
+        log_record(&recorder, LOG_RECEIVED, 0, buf_from, rcount_server);
+    }
+    char * out = display_reserve(2 * rcount_server);
+    if (pty_set) {
+        // the remote terminal already turned <lf> into <cr><lf>
+        memcpy(out, buf_from, rcount_server);
+        display_len += rcount_server;
+    }
+    else {
+        display_len += translate_crlf(out, buf_from, rcount_server, SCAN_LF);
+    }
+    if (display_len >= DISPLAY_FLUSH) {
+        display_flush();
+    }
+}
+
+// the local client of channel ch is gone: close its connection
+void channel_disconnect(struct channel * ch) {
+    reactor_del(epfd, &ch->ev);
+    close_wrap(ch->ev.fd, 31);
+    frame_reader_free(&ch->in);
+    free(ch->out);
+    ch->out = NULL;
+    ch->out_len = ch->out_off = ch->out_data = 0;
+}
+
+// the local client of channel ch left (or failed): the server closes
+// the channel too
+void channel_hangup(struct channel * ch) {
+    channel_disconnect(ch);
+    if (ch->state == CHAN_HELLO) {
+        ch->state = CHAN_FREE;
+        return;
+    }
+    mux_send(ch, CTRL_CLOSE, 0);
+    ch->state = CHAN_CLOSING;
+}
+
+// write the queued output of channel ch as far as its local client
+// takes it; once all is written the server gets credit for it
+void channel_flush(struct channel * ch) {
+    while (ch->out_off < ch->out_len) {
+        ssize_t n = write(ch->ev.fd, ch->out + ch->out_off, ch->out_len - ch->out_off);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
             }
-            // ...and convert <cr> for write to server
-            switch (c) {
-                case 0x0D: // <cr>
-                    buf_to[i] = 0x0A; // <lf>
-                    break;
+            if (errno != EAGAIN) {
+                channel_hangup(ch);
             }
+            return; // EAGAIN: again on EPOLLOUT
         }
-        
-        //WRITE server read to stdout
-        for (i = 0; i < rcount_server; i++) {
-            c = buf_from[i];
-            switch (c) {
-                case 0x0A: // <lf>
-                    write_wrap(1, cr_lf, 2, "to display [2]");
-                    break;
-                default:
-                    write_wrap(1, &c, 1, "to display [2]");
+        ch->out_off += n;
+    }
+    ch->out_len = ch->out_off = 0;
+    mux_credit(ch, ch->out_data);
+    ch->out_data = 0;
+}
+
+// append nbyte bytes to the output queue of channel ch
+void channel_queue(struct channel * ch, const void * buf, size_t nbyte) {
+    char * out = realloc(ch->out, ch->out_len + nbyte);
+    if (out == NULL) {
+        fprintf(stderr, "Error allocating channel output: %s\n", strerror(errno));
+        exit(1);
+    }
+    ch->out = out;
+    memcpy(ch->out + ch->out_len, buf, nbyte);
+    ch->out_len += nbyte;
+}
+
+// data from the server for channel arg: the display for channel 0, the
+// local client of the channel for the others
+void channel_data (void * arg, char * buf, int nbyte) {
+    struct channel * ch = arg;
+    if (ch == &channels[0]) {
+        display(NULL, buf, nbyte);
+        mux_credit(ch, nbyte);
+        data_received += nbyte;
+        return;
+    }
+    if (ch->state != CHAN_OPEN) {
+        return; // sent before the server saw our CTRL_CLOSE
+    }
+    if (ch->framed) {
+        unsigned char hdr[FRAME_HDR_SIZE];
+        frame_header(hdr, 0, CODEC_NONE, nbyte);
+        channel_queue(ch, hdr, FRAME_HDR_SIZE);
+    }
+    channel_queue(ch, buf, nbyte);
+    ch->out_data += nbyte;
+    channel_flush(ch);
+}
+
+// a control frame from the server for channel f->channel (--mux)
+void mux_control(struct frame * f) {
+    struct channel * ch = &channels[f->channel];
+    unsigned char hello[FRAME_HELLO_SIZE];
+    uint32_t value;
+    switch (channel_ctrl_parse(f, &value)) {
+        case CTRL_OPEN:
+            // answer the local client's HELLO with what the server granted
+            if (ch->state != CHAN_OPENING) {
+                break;
+            }
+            ch->state = CHAN_OPEN;
+            ch->framed = value & HELLO_PTY;
+            // queued like the data after it, never waiting for the client
+            channel_queue(ch, hello, frame_hello(hello, CODEC_NONE, 0, 0, value & HELLO_PTY));
+            channel_flush(ch);
+            if (ch->state == CHAN_OPEN) {
+                channel_resume(ch);
+            }
+            break;
+        case CTRL_CLOSE:
+            if (ch->state == CHAN_OPENING || ch->state == CHAN_OPEN) {
+                channel_disconnect(ch);
             }
+            if (ch != &channels[0]) {
+                ch->state = CHAN_FREE;
+            }
+            break;
+        case CTRL_WINDOW:
+            ch->window += value;
+            if (ch->window > 0 && ch->state == CHAN_OPEN) {
+                channel_resume(ch);
+            }
+            break;
+    }
+}
+
+// data for channel ch to the server, which may pause the channel's
+// input (see channel_pause())
+void channel_send(struct channel * ch, char * buf, int nbyte) {
+    char * frame = pool_get(FRAME_BOUND(nbyte));
+    int frame_bytes = frame_compress(&codec, frame, buf, nbyte);
+    frame_channel(frame, ch - channels);
+    server_write(frame, frame_bytes);
+    if (log_set) {
+        log_sent(frame, frame_bytes);
+    }
+    pool_put(frame);
+    ch->window -= nbyte;
+    if (ch->window <= 0) {
+        channel_pause(ch);
+    }
+}
+
+// the HELLO of the local client of channel ch: the server is asked for
+// a channel with the pty it wants
+void local_hello(struct channel * ch) {
+    struct frame f;
+    int codec, level;
+    uint8_t mask, flags;
+    uint32_t dict;
+    int status = frame_next(&ch->in, &f);
+    if (status == 0) {
+        return;
+    }
+    if (status == -1 || hello_parse(&f, &codec, &level, &mask, &dict, &flags) == -1) {
+        fprintf(stderr, "Error with local client: first frame is not a HELLO\n");
+        channel_hangup(ch);
+        return;
+    }
+    // it sends nothing more until the answer
+    channel_pause(ch);
+    frame_reader_free(&ch->in);
+    ch->state = CHAN_OPENING;
+    ch->window = CHANNEL_WINDOW;
+    ch->unacked = 0;
+    mux_send(ch, CTRL_OPEN, flags & HELLO_PTY);
+}
+
+// a local client is ready (edge-triggered): write its queued output,
+// and read until EAGAIN or until its window is used up
+void local_event(struct event * ev, uint32_t events) {
+    struct channel * ch = ev->data;
+    if (events & EPOLLOUT && ch->state == CHAN_OPEN) {
+        channel_flush(ch);
+    }
+    char * buf = pool_get(buf_size);
+    struct frame f;
+    int rcount;
+
+    while (!ch->paused && !input_paused && (ch->state == CHAN_HELLO || ch->state == CHAN_OPEN) && !done) {
+        if (ch->state == CHAN_HELLO || ch->framed) {
+            rcount = frame_read(&ch->in, ev->fd, buf_size, "from local client");
+        }
+        else {
+            rcount = read_peer(ev->fd, buf, buf_size, "from local client");
         }
-        
-        //WRITE stdin to server
-        def_bytes = 0;
-        if (rcount_stdin > 0) {
-            if (compress_set) {
-                def_bytes = zcompress_new(tmp_buf,buf_to, rcount_stdin, buf_size);
-                write_wrap(sockfd, tmp_buf, def_bytes, "compress server");
+        if (rcount == -1) {
+            break; // EAGAIN, everything read
+        }
+        if (rcount == 0) {
+            channel_hangup(ch);
+            break;
+        }
+        if (ch->state == CHAN_HELLO) {
+            local_hello(ch);
+            continue;
+        }
+        if (!ch->framed) {
+            channel_send(ch, buf, rcount);
+            continue;
+        }
+        int status;
+        int rows, cols;
+        while ((status = frame_next(&ch->in, &f)) == 1) {
+            unsigned char * frame = f.payload - FRAME_HDR_SIZE;
+            if (f.flags & FRAME_CONTROL) {
+                // the size of its terminal, for the channel's pty
+                if (winsize_parse(&f, &rows, &cols) == 0) {
+                    frame_channel(frame, ch - channels);
+                    server_write(frame, FRAME_HDR_SIZE + f.len);
+                }
+                continue;
             }
-            else {
-                write_wrap(sockfd, buf_to, rcount_stdin, "to server [1]");
+            if (f.flags & FRAME_COMPRESSED) {
+                status = -1; // it was offered no codec
+                break;
+            }
+            if (f.len > 0) {
+                channel_send(ch, (char *)f.payload, f.len);
             }
         }
-        
-        // LOGGING bytes written to server
-        if (log_set) {
-            if (compress_set && def_bytes > 0) {
-                log_sent(tmp_buf, def_bytes);
+        if (status == -1) {
+            channel_hangup(ch);
+            break;
+        }
+    }
+    pool_put(buf);
+}
+
+// another client started with the same --mux path: it gets the lowest
+// free channel, or is turned away when all are taken
+void mux_event(struct event * ev, uint32_t events) {
+    (void) events;
+    while (1) {
+        int fd = accept4(ev->fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+        if (fd == -1) {
+            if (errno == ECONNABORTED || errno == EINTR) {
+                continue;
             }
-            else if (rcount_stdin > 0) {
-                log_sent(buf_to, rcount_stdin);
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                fprintf(stderr, "Error accepting local client: %s\n", strerror(errno));
             }
+            return;
+        }
+        int i = 1;
+        while (i < CHANNEL_MAX && channels[i].state != CHAN_FREE) {
+            i++;
+        }
+        if (i == CHANNEL_MAX) {
+            close_wrap(fd, 32);
+            continue;
+        }
+        struct channel * ch = &channels[i];
+        ch->state = CHAN_HELLO;
+        ch->paused = false;
+        ch->framed = false;
+        frame_reader_init(&ch->in);
+        ch->ev.fd = fd;
+        ch->ev.handler = local_event;
+        ch->ev.data = ch;
+        reactor_add(epfd, &ch->ev, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+    }
+}
+
+// listen on the --mux path for the clients started after this one; a
+// socket file left by an earlier run is replaced
+void mux_listen() {
+    struct sockaddr_un addr;
+    socklen_t len = unix_address(&addr, mux_path);
+    mux_ev.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (mux_ev.fd == -1) {
+        fprintf(stderr, "Error creating socket: %s\n", strerror(errno));
+        exit(1);
+    }
+    if (mux_path[0] != '@') {
+        unlink(mux_path);
+    }
+    if (bind(mux_ev.fd, (struct sockaddr *)&addr, len) == -1 || listen(mux_ev.fd, SOMAXCONN) == -1) {
+        fprintf(stderr, "Error listening on %s: %s\n", mux_path, strerror(errno));
+        exit(1);
+    }
+    mux_ev.handler = mux_event;
+    reactor_add(epfd, &mux_ev, EPOLLIN | EPOLLET);
+}
+
+// the token of the session from the --detach file, false if there is
+// none (yet)
+bool token_load() {
+    FILE * f = fopen(token_path, "r");
+    if (f == NULL) {
+        return false;
+    }
+    int i;
+    unsigned int byte;
+    for (i = 0; i < TOKEN_SIZE && fscanf(f, "%2x", &byte) == 1; i++) {
+        token[i] = byte;
+    }
+    fclose(f);
+    return i == TOKEN_SIZE;
+}
+
+// keep the token of the session in the --detach file, readable only by
+// the user: it is all it takes to get into the session
+void token_save() {
+    int fd = open(token_path, O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        fprintf(stderr, "Error with --detach file %s: %s\r\n", token_path, strerror(errno));
+        return;
+    }
+    char hex[2 * TOKEN_SIZE + 1];
+    int i;
+    for (i = 0; i < TOKEN_SIZE; i++) {
+        snprintf(hex + 2 * i, 3, "%02x", token[i]);
+    }
+    hex[2 * TOKEN_SIZE] = '\n';
+    write_wrap(fd, hex, sizeof(hex), "token");
+    close_wrap(fd, 34);
+}
+
+// a control frame from the server of a detachable session: the token
+// with the count of data bytes before what follows, or CTRL_CLOSE once
+// the session is over
+void detach_control(struct frame * f) {
+    uint32_t value;
+    if (token_parse(f, token, &data_received) == 0) {
+        token_set = true;
+        if (token_path != NULL) {
+            token_save();
         }
-        
+    }
+    else if (channel_ctrl_parse(f, &value) == CTRL_CLOSE) {
+        session_over = true;
+    }
+}
+
+// the server socket is ready (edge-triggered): write what is queued
+// for it, and read until EAGAIN
+void server_event(struct event * ev, uint32_t events) {
+    if (events & EPOLLOUT) {
+        server_drained();
+    }
+    char * buf_from = framed ? NULL : pool_get(buf_size);
+    char * inflate_buf = framed ? pool_get(buf_size) : NULL;
+    char * received;
+    struct frame f;
+    int rcount_server;
+
+    while (!done && !reconnect) {
+        // READ from server
+        // (into the frame reassembly buffer for --compress)
+        if (framed) {
+            rcount_server = frame_read(&in, ev->fd, buf_size, "from server [1]");
+        }
+        else {
+            rcount_server = read_peer(ev->fd, buf_from, buf_size, "from server [1]");
+        }
+        if (rcount_server == -1) {
+            break; // EAGAIN, everything read
+        }
+
         // SHUTDOWN
-        if (fds[1].revents & (POLLHUP | POLLERR)) {
+        if (rcount_server == 0) {
+            server_lost();
             break;
         }
-        if (fds[0].revents & (POLLHUP | POLLERR)) {
-            break;
+        // the bytes just read, at the end of the reassembly buffer
+        received = framed ? (char *)in.buf + in.end - rcount_server : buf_from;
+
+        // LOG received bytes
+        if (log_set) {
+            log_received(received, rcount_server);
         }
-        if (rcount_server == 0 || rcount_stdin == 0) {
-            break;
+
+        // decompress
+        if (!framed) {
+            display(NULL, buf_from, rcount_server);
+            continue;
+        }
+        int status;
+        while ((status = frame_next(&in, &f)) == 1) {
+            if (f.flags & FRAME_CONTROL) {
+                if (mux_on) {
+                    mux_control(&f);
+                }
+                else if (detach_set) {
+                    detach_control(&f);
+                }
+                continue;
+            }
+            struct channel * ch = mux_on ? &channels[f.channel] : &channels[0];
+            if (frame_decode(&codec, &f, inflate_buf, buf_size, channel_data, ch) == -1) {
+                status = -1;
+                break;
+            }
+        }
+        if (status == -1) {
+            done = true;
         }
-        
     }
-    
+    pool_put(buf_from);
+    pool_put(inflate_buf);
+}
+
+// send the size of the terminal to the server (option --pty)
+void send_winsize () {
+    struct winsize ws;
+    if (ioctl(0, TIOCGWINSZ, &ws) == -1) {
+        return; // not a terminal, keep the pty's default
+    }
+    unsigned char frame[FRAME_WINSIZE_SIZE];
+    server_write(frame, frame_winsize(frame, ws.ws_row, ws.ws_col));
+}
+
+// SIGWINCH through a signalfd: the terminal was resized
+void winch_event(struct event * ev, uint32_t events) {
+    (void) events;
+    struct signalfd_siginfo info;
+    while (read(ev->fd, &info, sizeof(info)) == sizeof(info)) {
+        ;
+    }
+    send_winsize();
+}
+
+// SIGWINCH is delivered to winch_ev instead of a handler
+void winch_start () {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGWINCH);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1) {
+        fprintf(stderr, "Error blocking SIGWINCH: %s\n", strerror(errno));
+        exit(1);
+    }
+    winch_ev.fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (winch_ev.fd == -1) {
+        fprintf(stderr, "Error creating signalfd: %s\n", strerror(errno));
+        exit(1);
+    }
+    winch_ev.handler = winch_event;
+    reactor_add(epfd, &winch_ev, EPOLLIN);
+    send_winsize();
+}
+
+// connect to the server (--unix or --host and --port), false if it
+// cannot be reached
+bool server_connect() {
+    return unix_path != NULL ? unix_socket() : client_socket();
+}
+
+// agree on the codec, the pty and the channels; the server may turn
+// them down. A detachable session that has a token is resumed. -1 if
+// the server does not answer.
+int server_handshake() {
+    uint8_t flags = (pty_set ? HELLO_PTY : 0) | (mux_path != NULL ? HELLO_MUX : 0) |
+                    (detach_set ? HELLO_DETACH : 0);
+    if (codec_handshake(sockfd, &codec, codec_id, codec_level, &flags,
+                        token_set ? token : NULL, data_received) == -1) {
+        return -1;
+    }
+    if (pty_set && !(flags & HELLO_PTY)) {
+        fprintf(stderr, "Server has no --pty, the shell runs on pipes\r\n");
+        pty_set = false;
+    }
+    mux_on = flags & HELLO_MUX;
+    if (mux_path != NULL && !mux_on) {
+        fprintf(stderr, "Server has no --shell, --mux is ignored\r\n");
+    }
+    if (detach_set && !(flags & HELLO_DETACH)) {
+        fprintf(stderr, "Server has no --detach, the session ends with the connection\r\n");
+        detach_set = false;
+    }
+    if (token_set && !(flags & HELLO_RESUME)) {
+        fprintf(stderr, "The session is gone, this is a new one\r\n");
+        token_set = false;
+    }
+    framed = codec.id != CODEC_NONE || pty_set || mux_on || detach_set;
+    frame_reader_init(&in);
+    return 0;
+}
+
+// the connection to the server of a detachable session was lost: try
+// to resume the session on a new one for up to connect_timeout seconds,
+// false if that failed
+bool server_reconnect() {
+    reactor_del(epfd, &server_ev);
+    close_wrap(sockfd, 32);
+    outq_free(&to_server);
+    codec_end(&codec);
+    frame_reader_free(&in);
+    input_paused = false;
+    stdin_update();
+    display_flush();
+    fprintf(stderr, "\r\nConnection lost, resuming the session\r\n");
+
+    struct timespec retry = {1, 0};
+    long deadline = now_ms() + connect_timeout * 1000L;
+    bool resumed = false;
+    while (!resumed && now_ms() < deadline) {
+        if (!server_connect()) {
+            nanosleep(&retry, NULL);
+            continue;
+        }
+        resumed = server_handshake() == 0;
+        if (!resumed) {
+            close_wrap(sockfd, 32);
+        }
+    }
+    if (!resumed) {
+        return false;
+    }
+    reconnect = false;
+    server_ev.fd = sockfd;
+    set_nonblock(sockfd);
+    reactor_add(epfd, &server_ev, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+    // the terminal may have been resized meanwhile
+    if (pty_set) {
+        send_winsize();
+    }
+    return true;
+}
+
+// reading and writing
+// sleeps in the event loop until the keyboard or the server has data
+void term_rw () {
+    epfd = reactor_create();
+
+    stdin_ev.fd = 0;
+    stdin_ev.handler = stdin_event;
+    reactor_add(epfd, &stdin_ev, EPOLLIN);
+
+    server_ev.fd = sockfd;
+    server_ev.handler = server_event;
+    set_nonblock(sockfd);
+    reactor_add(epfd, &server_ev, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+
+    channels[0].state = CHAN_OPEN;
+    channels[0].window = CHANNEL_WINDOW;
+    if (mux_on) {
+        mux_listen();
+    }
+
+    if (pty_set) {
+        winch_start();
+    }
+
+    while (!done) {
+        reactor_run(epfd, -1);
+        // one write to the display per pass
+        display_flush();
+        if (reconnect && !server_reconnect()) {
+            done = true;
+        }
+    }
+    display_flush();
 }
 
 /*
@@ -242,8 +1120,6 @@ void term_rw (bool log_set, bool compress_set) {
  */
 int main(int argc, char * argv[]) {
     bool port_set = false;
-    bool log_set = false;
-    bool compress_set = false;
     
     int opt;
     while((opt = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
@@ -257,16 +1133,93 @@ int main(int argc, char * argv[]) {
                 logname = optarg;
                 break;
             case 'c':
-                compress_set = true;
+                if (codec_parse(optarg, &codec_id, &codec_level) == -1) {
+                    fprintf(stderr, "Error with --compress: unknown codec %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'b':
+                buf_size = strtoul(optarg, NULL, 10);
+                if (buf_size == 0 || buf_size > FRAME_MAX) {
+                    fprintf(stderr, "Error with --bufsize: must be 1 to %d bytes\n", FRAME_MAX);
+                    exit(1);
+                }
+                break;
+            case 'd':
+                dict_load(optarg);
+                break;
+            case 't':
+                pty_set = true;
+                break;
+            case 'u':
+                unix_path = optarg;
+                break;
+            case 'h':
+                host = optarg;
+                break;
+            case 'T':
+                connect_timeout = atoi(optarg);
+                if (connect_timeout <= 0) {
+                    fprintf(stderr, "Error with --connect-timeout: must be at least 1 second\n");
+                    exit(1);
+                }
+                break;
+            case 'm':
+                mux_path = optarg;
+                break;
+            case 'D':
+                detach_set = true;
+                token_path = optarg;
+                break;
+            case 'r':
+                record_set = true;
+                record_open(&recorder, optarg);
+                break;
+            case 'f':
+                if (strcmp(optarg, "text") == 0) {
+                    log_format = LOG_TEXT;
+                }
+                else if (strcmp(optarg, "binary") == 0) {
+                    log_format = LOG_BINARY;
+                }
+                else {
+                    fprintf(stderr, "Error with --log-format: text or binary\n");
+                    exit(1);
+                }
+                break;
+            case 'o':
+                if (strcmp(optarg, "drop") == 0) {
+                    log_policy = LOG_DROP;
+                }
+                else if (strcmp(optarg, "block") == 0) {
+                    log_policy = LOG_BLOCK;
+                }
+                else {
+                    fprintf(stderr, "Error with --log-policy: drop or block\n");
+                    exit(1);
+                }
                 break;
             default:
-                fprintf(stderr, "usage: ./twoface-client --port=<num> [--log=<filename>] [--compress]\n");
+                fprintf(stderr, "usage: ./twoface-client --port=<num> [--log=<filename>] [--log-format=text|binary] [--log-policy=drop|block] [--compress[=<codec>[:<level>]]] [--bufsize=<bytes>] [--dict=<file>] [--pty] [--record=<file>] [--unix=<path>] [--host=<name>] [--connect-timeout=<sec>] [--mux=<path>] [--detach[=<file>]]\n");
                 exit(1);
         }
     }
-    // --port is mandatory
-    if (!port_set) {
-        fprintf(stderr, "usage: ./twoface-client --port=<num> [--log=<filename>] [--compress]\n");
+    // a client that joins another one with --mux needs no server address
+    bool joined = mux_path != NULL && mux_join();
+    if (joined) {
+        mux_path = NULL;
+    }
+    // the channels of a --mux connection end with it
+    if (detach_set && (joined || mux_path != NULL)) {
+        fprintf(stderr, "--detach does not work with --mux, ignored\n");
+        detach_set = false;
+    }
+    if (detach_set && token_path != NULL) {
+        token_set = token_load();
+    }
+    // --port (or --unix) is mandatory
+    if (!joined && !port_set && unix_path == NULL) {
+        fprintf(stderr, "usage: ./twoface-client --port=<num> [--log=<filename>] [--log-format=text|binary] [--log-policy=drop|block] [--compress[=<codec>[:<level>]]] [--bufsize=<bytes>] [--dict=<file>] [--pty] [--record=<file>] [--unix=<path>] [--host=<name>] [--connect-timeout=<sec>] [--mux=<path>] [--detach[=<file>]]\n");
         exit(1);
     }
     
@@ -277,19 +1230,36 @@ int main(int argc, char * argv[]) {
             fprintf(stderr, "Error open/create log: %s\n", strerror(errno));
             exit(1);
         }
+        log_open(&logger, log_fd, LOG_RING_SIZE, log_format, log_policy);
     }
     
-    client_socket();
-    
-    //set polls
-    fds[0].fd = 0;
-    fds[0].events = POLLIN | POLLHUP | POLLERR;
-    fds[1].fd = sockfd;
-    fds[1].events = POLLIN | POLLHUP | POLLERR;
-    
+    // connected in mux_join() when joined
+    if (!joined && !server_connect()) {
+        exit(1);
+    }
+    if (server_handshake() == -1) {
+        exit(1);
+    }
+
     //terminal
     term_adjust();
-    term_rw(log_set, compress_set);
+    term_rw();
     term_reset();
+    if (mux_on && mux_path[0] != '@') {
+        unlink(mux_path);
+    }
+    // the token is only good while the session lasts
+    if (token_path != NULL && session_over) {
+        unlink(token_path);
+    }
+    else if (token_path != NULL && token_set) {
+        fprintf(stderr, "The session can be resumed with --detach=%s\n", token_path);
+    }
+    if (log_set) {
+        log_close(&logger);
+    }
+    if (record_set) {
+        log_close(&recorder);
+    }
     exit(0);
 }
@@ -0,0 +1,334 @@
+#include <unistd.h>
+#include <string.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdbool.h>
+
+#include "common.h"
+// has wrapper functions for system calls
+// as well as functions for compression
+
+// Trains a preset dictionary (option --dict) from client logs (text or
+// binary, see common.h). The
+// SENT and RECEIVED records of the logs are the samples; the
+// dictionary is made of the segments of them whose short substrings
+// (DMER bytes) occur most often, most useful last since codecs reach
+// the end of a dictionary most cheaply. The client logs the bytes on
+// the socket: with --compress, --pty, --detach or --mux those are
+// frames (see common.h), which are decoded as the client decodes them.
+
+#define DMER 8              // substring length that is counted
+#define SEGMENT 64          // bytes per dictionary segment
+#define HASH_BITS 20
+
+// getopt_long options
+static struct option longopts[] = {
+    {"out", required_argument, NULL, 'o'},
+    {"size", required_argument, NULL, 's'},
+    {"dict", required_argument, NULL, 'd'},
+    { NULL, 0, NULL, 0}
+};
+
+// all samples back to back
+static unsigned char * data;
+static size_t data_len, data_cap;
+
+// One direction of a logged session. It is taken as frames when its
+// first record starts with FRAME_MAGIC; their data is decoded with a
+// codec stream that starts over wherever a frame does not decode,
+// which is where the client connected again (--detach). A frame that
+// does not decode on a new stream either (another --dict) ends it.
+#define STREAM_UNKNOWN 0
+#define STREAM_PLAIN 1
+#define STREAM_FRAMED 2
+#define STREAM_BROKEN 3 // does not decode, the rest is skipped
+struct stream {
+    int kind;
+    struct frame_reader in;
+    struct codec codec;
+};
+static bool use_dict = false; // option --dict, the sessions used it
+static unsigned char inflate_buf[FRAME_BURST];
+
+// one chosen segment of data
+struct segment {
+    size_t start;
+    unsigned long score;
+};
+
+void data_append(const unsigned char * buf, size_t nbyte) {
+    if (data_len + nbyte > data_cap) {
+        data_cap = data_cap ? data_cap : 1 << 16;
+        while (data_cap < data_len + nbyte) {
+            data_cap *= 2;
+        }
+        data = realloc(data, data_cap);
+        if (data == NULL) {
+            fprintf(stderr, "Error allocating samples: %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+    memcpy(data + data_len, buf, nbyte);
+    data_len += nbyte;
+}
+
+// next record of a binary log, 0 at the end
+int next_binary(FILE * f, int * dir, int * nbyte) {
+    unsigned char h[LOG_RECORD_HDR];
+    if (fread(h, 1, LOG_RECORD_HDR, f) != LOG_RECORD_HDR) {
+        return 0;
+    }
+    *nbyte = (uint32_t)h[8] << 24 | h[9] << 16 | h[10] << 8 | h[11];
+    *dir = h[12];
+    return 1;
+}
+
+// next record of a text log, 0 at the end
+// (the data may start with blanks, so the space is read by hand)
+int next_text(FILE * f, int * dir, int * nbyte) {
+    char word[16];
+    if (fscanf(f, "%15s %d bytes:", word, nbyte) != 2 || fgetc(f) != ' ') {
+        return 0;
+    }
+    *dir = strcmp(word, "DROPPED") == 0 ? LOG_DROPPED :
+           strcmp(word, "RECEIVED") == 0 ? LOG_RECEIVED : LOG_SENT;
+    return 1;
+}
+
+// decoded data of a frame, a sample
+void sample(void * arg, char * buf, int nbyte) {
+    (void) arg;
+    data_append((unsigned char *)buf, nbyte);
+}
+
+// decode frame f of stream s, -1 if it does not decode
+int stream_decode(struct stream * s, struct frame * f) {
+    size_t before = data_len;
+    if (f->codec >= CODEC_COUNT) {
+        return -1;
+    }
+    if ((f->flags & FRAME_COMPRESSED) && f->codec != s->codec.id) {
+        codec_end(&s->codec);
+        codec_init(&s->codec, f->codec, 0, use_dict);
+    }
+    if (frame_decode(&s->codec, f, inflate_buf, sizeof(inflate_buf), sample, NULL) == -1) {
+        data_len = before;
+        return -1;
+    }
+    return 0;
+}
+
+// the samples of a record of nbyte logged bytes of stream s; false if
+// (some of) it could not be decoded
+bool stream_add(struct stream * s, const unsigned char * buf, int nbyte) {
+    if (s->kind == STREAM_UNKNOWN) {
+        s->kind = buf[0] == FRAME_MAGIC ? STREAM_FRAMED : STREAM_PLAIN;
+    }
+    if (s->kind == STREAM_PLAIN) {
+        data_append(buf, nbyte);
+        return true;
+    }
+    if (s->kind == STREAM_BROKEN) {
+        return false;
+    }
+    frame_reader_append(&s->in, buf, nbyte);
+    struct frame f;
+    int status;
+    while ((status = frame_next(&s->in, &f)) == 1) {
+        if (f.flags & FRAME_CONTROL) {
+            continue;
+        }
+        if (stream_decode(s, &f) == -1) {
+            // a new connection starts a new codec stream
+            codec_end(&s->codec);
+            codec_init(&s->codec, CODEC_NONE, 0, false);
+            if (stream_decode(s, &f) == -1) {
+                status = -1;
+                break;
+            }
+        }
+    }
+    if (status == -1) {
+        s->kind = STREAM_BROKEN;
+        return false;
+    }
+    return true;
+}
+
+// add the records of a log written by twoface-client --log, in text
+// ("SENT <n> bytes: ", n bytes and a newline) or binary format
+void read_log(const char * path) {
+    FILE * f = fopen(path, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "Error opening log %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    char magic[LOG_MAGIC_SIZE];
+    bool binary = fread(magic, 1, LOG_MAGIC_SIZE, f) == LOG_MAGIC_SIZE &&
+                  memcmp(magic, LOG_MAGIC, LOG_MAGIC_SIZE) == 0;
+    if (!binary) {
+        rewind(f);
+    }
+    int dir, nbyte;
+    int failed = 0;
+    size_t before = data_len;
+    struct stream streams[2]; // LOG_SENT, LOG_RECEIVED
+    memset(streams, 0, sizeof(streams));
+    unsigned char * buf = NULL;
+    while ((binary ? next_binary(f, &dir, &nbyte) : next_text(f, &dir, &nbyte)) && nbyte > 0) {
+        buf = realloc(buf, nbyte);
+        if (buf == NULL) {
+            fprintf(stderr, "Error allocating record: %s\n", strerror(errno));
+            exit(1);
+        }
+        if (fread(buf, 1, nbyte, f) != (size_t)nbyte || (!binary && fgetc(f) != '\n')) {
+            break; // log cut off
+        }
+        if (dir == LOG_DROPPED) {
+            continue;
+        }
+        if (!stream_add(&streams[dir == LOG_RECEIVED], buf, nbyte)) {
+            failed++;
+        }
+    }
+    if (failed > 0) {
+        fprintf(stderr, "%s: %d records could not be decoded%s\n", path, failed,
+                use_dict ? "" : " (recorded with --dict?)");
+    }
+    if (data_len == before) {
+        fprintf(stderr, "%s: no samples\n", path);
+    }
+    int i;
+    for (i = 0; i < 2; i++) {
+        frame_reader_free(&streams[i].in);
+        codec_end(&streams[i].codec);
+    }
+    free(buf);
+    fclose(f);
+}
+
+static uint32_t dmer_hash(const unsigned char * p) {
+    uint64_t v;
+    memcpy(&v, p, DMER);
+    return (v * 0x9E3779B97F4A7C15ULL) >> (64 - HASH_BITS);
+}
+
+int compare_score(const void * a, const void * b) {
+    const struct segment * x = a, * y = b;
+    return (x->score > y->score) - (x->score < y->score);
+}
+
+// pick size / SEGMENT segments, the best one from each of as many
+// equal parts (epochs) of the samples, so one pass over the data does.
+// A chosen segment's substrings stop counting for the later ones.
+size_t train(unsigned char * dict, size_t size) {
+    if (data_len <= size) {
+        memcpy(dict, data, data_len);
+        return data_len;
+    }
+    uint32_t * freq = calloc(1 << HASH_BITS, sizeof(uint32_t));
+    size_t nseg = size / SEGMENT;
+    struct segment * segs = calloc(nseg, sizeof(struct segment));
+    if (freq == NULL || segs == NULL) {
+        fprintf(stderr, "Error allocating training tables: %s\n", strerror(errno));
+        exit(1);
+    }
+    size_t i, n;
+    for (i = 0; i + DMER <= data_len; i++) {
+        freq[dmer_hash(data + i)]++;
+    }
+
+    size_t epoch = data_len / nseg;
+    for (n = 0; n < nseg; n++) {
+        size_t begin = n * epoch;
+        size_t end = begin + epoch + SEGMENT < data_len ? begin + epoch + SEGMENT : data_len;
+        unsigned long score = 0, best = 0;
+        size_t best_start = begin;
+        // sliding sum over the dmers starting in [start, start + SEGMENT - DMER]
+        for (i = begin; i + DMER <= end; i++) {
+            score += freq[dmer_hash(data + i)];
+            if (i >= begin + SEGMENT - DMER + 1) {
+                score -= freq[dmer_hash(data + i - (SEGMENT - DMER + 1))];
+            }
+            if (i >= begin + SEGMENT - DMER && score > best) {
+                best = score;
+                best_start = i - (SEGMENT - DMER);
+            }
+        }
+        segs[n].start = best_start;
+        segs[n].score = best;
+        for (i = best_start; i + DMER <= best_start + SEGMENT; i++) {
+            freq[dmer_hash(data + i)] = 0;
+        }
+    }
+
+    // most useful segments at the end
+    qsort(segs, nseg, sizeof(struct segment), compare_score);
+    size_t len = 0;
+    for (n = 0; n < nseg; n++) {
+        if (segs[n].score > 0) {
+            memcpy(dict + len, data + segs[n].start, SEGMENT);
+            len += SEGMENT;
+        }
+    }
+    free(freq);
+    free(segs);
+    return len;
+}
+
+/*
+ PROGRAM BEGINS
+ */
+int main(int argc, char * argv[]) {
+    char * out = NULL;
+    size_t size = 16 * 1024;
+
+    int opt;
+    while((opt = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
+        switch (opt) {
+            case 'o':
+                out = optarg;
+                break;
+            case 's':
+                size = strtoul(optarg, NULL, 10);
+                break;
+            case 'd':
+                dict_load(optarg);
+                use_dict = true;
+                break;
+            default:
+                fprintf(stderr, "usage: ./twoface-dict --out=<file> [--size=<bytes>] [--dict=<file>] <log>...\n");
+                exit(1);
+        }
+    }
+    if (out == NULL || optind == argc || size < SEGMENT || size > DICT_MAX) {
+        fprintf(stderr, "usage: ./twoface-dict --out=<file> [--size=<bytes>] [--dict=<file>] <log>...\n");
+        exit(1);
+    }
+
+    for (; optind < argc; optind++) {
+        read_log(argv[optind]);
+    }
+    if (data_len < DMER) {
+        fprintf(stderr, "Error: no samples in the logs\n");
+        exit(1);
+    }
+
+    unsigned char * dict = malloc(size);
+    if (dict == NULL) {
+        fprintf(stderr, "Error allocating dictionary: %s\n", strerror(errno));
+        exit(1);
+    }
+    size_t len = train(dict, size);
+
+    FILE * f = fopen(out, "wb");
+    if (f == NULL || fwrite(dict, 1, len, f) != len || fclose(f) != 0) {
+        fprintf(stderr, "Error writing dictionary %s: %s\n", out, strerror(errno));
+        exit(1);
+    }
+    printf("%zu byte dictionary from %zu bytes of samples\n", len, data_len);
+    free(dict);
+    exit(0);
+}
@@ -1,18 +1,28 @@
+#define _GNU_SOURCE // pipe2(), accept4()
 #include <termios.h>
 #include <unistd.h>
 #include <sys/wait.h>
 #include <signal.h>
 #include <string.h>
-#include <poll.h>
 #include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdbool.h>
+#include <fcntl.h>
 
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <netdb.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/ioctl.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+#include <pthread.h>
 
 #include "common.h"
 // has wrapper functions for system calls
@@ -26,259 +36,2039 @@
 static struct option longopts[] = {
     {"port", required_argument, NULL, 'p'},
     {"shell", required_argument, NULL, 's'},
-    {"compress", no_argument, NULL, 'c'},
+    {"compress", optional_argument, NULL, 'c'},
+    {"bufsize", required_argument, NULL, 'b'},
+    {"dict", required_argument, NULL, 'd'},
+    {"pool", required_argument, NULL, 'P'},
+    {"pty", no_argument, NULL, 't'},
+    {"record", required_argument, NULL, 'R'},
+    {"pool-rate", required_argument, NULL, 'r'},
+    {"metrics", required_argument, NULL, 'm'},
+    {"unix", required_argument, NULL, 'u'},
+    {"io", required_argument, NULL, 'i'},
+    {"workers", required_argument, NULL, 'w'},
+    {"detach", required_argument, NULL, 'D'},
+    {"scrollback", required_argument, NULL, 'S'},
     { NULL, 0, NULL, 0}
 };
 
-// fd[0] is for fd of socket connection and fd[1] is for pipe that returns
-// output from the shell. Initialized when option --shell is specified
-static struct pollfd fds[2];
+// options shared by every session
+static bool forwarding = false;
+static bool pty_allowed = false; // option --pty, for clients that ask
+static int server_codec = CODEC_NONE; // option --compress[=<codec>[:<level>]]
+static int server_level = 0;
+static char * program;
+static size_t buf_size = 256*2; // bytes per read, option --bufsize
+static bool io_uring_set = false; // option --io=uring
+static __thread bool io_uring_on = false; // this worker got io_uring
 
-// File desciptors for forwarding to child process and reading from
-// child process. These are initialized in the parent process when
-// option --shell is specified.
-static int forward_fd;
-static int read_fd;
+// all sessions recorded into one file, told apart by their number
+// (option --record)
+static bool record_set = false;
+static struct logger recorder;
+static uint32_t sessions_started; // by all workers, atomic
 
-// PID of the shell process (if option --shell is used)
-static pid_t child_pid;
+// with --record, SIGINT and SIGTERM end serve() through a signalfd so
+// the recording is written out before the server exits. The other
+// workers are woken through wake_fd, an eventfd that stays readable.
+static sigset_t stop_signals;
+static struct event stop_ev;
+static bool stopping = false; // atomic
+static int wake_fd = -1;
+static __thread struct event wake_ev;
+
+// traffic of one direction: bytes of data, bytes on the socket (after
+// compression and framing) and frames
+#define TO_SHELL 0  // client to shell
+#define TO_CLIENT 1 // shell (or echo) to client
+struct traffic {
+    uint64_t data;
+    uint64_t wire;
+    uint64_t frames;
+};
+
+// the last size bytes of a session's output (the bytes before seq)
+struct scrollback {
+    char * buf;
+    size_t size;
+    uint64_t seq; // data bytes sent in all
+};
+
+// One session per accepted client. With option --shell every session
+// has its own shell child: forward_fd forwards to the shell and read_fd
+// (shell_ev.fd) returns output from the shell.
+// A client that agreed on HELLO_MUX opens more channels on its
+// connection (see common.h): each is a session of its own, with its
+// shell, traffic and id, whose conn is the session of channel 0. Only
+// that one has the socket, the codec and the frame reader, and its end
+// ends all of its channels.
+// Sockets and shell pipes are non-blocking. What the client or the
+// shell does not take at once waits in the output queue of its
+// direction; a queue above OUTQ_HIGH pauses whoever fills it (the
+// shell's output, the client's input, or with HELLO_MUX the channel's
+// CTRL_WINDOW credit) until it drained below OUTQ_LOW, so a slow peer
+// only holds up its own session.
+// A detachable session (HELLO_DETACH) keeps its shell when the client
+// is lost: it is detached, without a socket, until the client resumes
+// it with its token or detach_ev, a timerfd, ends it. Its output also
+// goes into the scrollback for the client to catch up on.
+struct session {
+    struct event sock_ev;  // socket connection to the client
+    struct event shell_ev; // output of the shell
+    int forward_fd;
+    bool forward_fd_open;
+    bool read_fd_open;
+    struct event forward_ev; // forward_fd, EPOLLOUT
+    struct outq to_shell;
+    struct outq to_client; // (owner of the socket)
+    bool forward_eof; // ^D: forward_fd is closed once to_shell is written
+    bool read_paused; // the client is not read while a queue is full
+    bool lost; // the client is gone, nothing more is written to it
+    bool draining; // ended, but to_client still waits for the client
+    bool waiting; // in the waiting list (io_uring)
+    struct session * next_waiting;
+    pid_t child_pid;
+    int proto; // PROTO_*, how the client talks
+    struct codec codec; // negotiated in the handshake, both directions
+    struct frame_reader in; // frames from the client
+    bool pty; // the shell runs on a pseudo-terminal (HELLO_PTY)
+    bool no_splice; // splice() failed or --record, copy shell output instead
+    bool shutdown;
+    uint32_t id; // number of the session (recording, metrics)
+    struct traffic traffic[2]; // TO_SHELL, TO_CLIENT
+    struct session * conn; // owner of the socket, NULL once it closed
+    uint8_t channel;
+    bool mux; // HELLO_MUX agreed (channel 0)
+    struct session ** channels; // CHANNEL_MAX, by channel (with mux)
+    int64_t window; // bytes the client still takes on the channel (mux)
+    uint32_t unacked; // bytes forwarded since the last CTRL_WINDOW sent
+    bool stalled; // shell output waits for CTRL_WINDOW or to_client
+    bool detachable; // HELLO_DETACH agreed, in the tokens list
+    bool detached; // no client, detach_ev is running
+    unsigned char token[TOKEN_SIZE];
+    struct scrollback scrollback;
+    struct event detach_ev;
+    struct worker * owner;
+    struct session * next_token;
+    struct session * prev, * next; // all open sessions
+    struct session * next_closing;
+};
+
+// A session starts in PROTO_UNKNOWN until the first bytes from the
+// client show whether it sends a HELLO (see common.h). Shell output
+// waits in the pipe until then.
+#define PROTO_UNKNOWN 0
+#define PROTO_RAW 1    // plain bytes both ways
+#define PROTO_FRAMED 2 // frames with the negotiated codec
+
+// a shell that is waited for through a pidfd, which becomes readable
+// when the shell exits. Outlives its session if the client leaves first.
+// Until a session takes its pipes it may wait in the shell pool.
+struct shell_proc {
+    struct event ev;
+    pid_t pid;
+    int forward_fd; // pipe into the shell (pty: a dup of the master)
+    int read_fd;    // pipe out of the shell (pty: the master)
+    bool pty;
+    bool pooled;
+    struct shell_proc * next_pooled;
+};
+
+// Shells started ahead of time (option --pool=<n>) so a new session
+// does not wait for fork(), exec() and the shell's startup. The pool is
+// filled when the server starts; taken shells are replaced at most
+// shell_pool_rate per second (option --pool-rate) from refill_ev, a timerfd
+// that only runs while the pool is short.
+static __thread struct shell_proc * shell_pool;
+static __thread int shell_pool_len;
+#define POOL_MAX 1024
+static int shell_pool_size = 0; // per worker, at most POOL_MAX
+#define POOL_RATE_MAX 1000
+static int shell_pool_rate = 10; // at most POOL_RATE_MAX
+static __thread struct event refill_ev;
+static __thread bool refill_armed = false;
+
+// sessions that ended during the current reactor_run(), closed after it
+static __thread struct session * closing;
+
+// with io_uring no EPOLLOUT tells when the ring wrote a queue out:
+// sessions paused for a queue are looked at after every reactor_run()
+static __thread struct session * waiting;
+
+// detachable sessions (option --detach=<sec>): kept for up to
+// detach_timeout seconds without a client, with the last
+// scrollback_size bytes of their output (option --scrollback=<bytes>).
+// A client may come back on any worker, so all of them are in tokens.
+static int detach_timeout = 0;
+#define SCROLLBACK_MAX (64 * 1024 * 1024)
+static size_t scrollback_size = 256 * 1024; // at most SCROLLBACK_MAX
+static pthread_mutex_t tokens_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct session * tokens;
+
+// metrics (option --metrics=<path>|<port>): Prometheus text for every
+// connection to a Unix socket at path, or HTTP on 127.0.0.1:port.
+// Traffic is counted per session and in total; with --metrics the
+// time from reading data to having written it on, per direction, goes
+// into the latency histograms.
+static bool metrics_set = false;
+static bool metrics_http;
+static struct event metrics_ev;
+static __thread struct session * sessions;
+static __thread int sessions_open;
+static __thread int sessions_detached;
+static __thread struct traffic traffic[2];
+static __thread struct histogram latency[2];
+
+// one metrics connection: (HTTP only) the request is read up to its
+// empty line, then text is written out as the socket takes it
+struct metrics_conn {
+    struct event ev;
+    char req[4];  // last bytes of the request
+    bool answered;
+    char * text;
+    size_t len, off;
+};
+
+// Worker threads (option --workers=<n>), each with its own event
+// loop, listening socket (SO_REUSEPORT on --port, the kernel spreads
+// the clients), sessions, shells, shell pool and buffer pool: a
+// session stays with the worker that accepted it, so the relay takes
+// no locks. Worker 0 runs in the main thread and also serves --metrics
+// and the stop signals. The per-worker variables are __thread;
+// struct worker gives --metrics their addresses. Counters are read
+// while their worker updates them, which at worst shows a value a
+// moment old. Only the session list, changed on open and close, is
+// locked. A client resuming a session of another worker is handed to
+// that worker through its handoffs and handoff_fd, an eventfd.
+struct handoff {
+    int fd;
+    size_t len;
+    struct handoff * next;
+    unsigned char in[]; // the client's HELLO and what came after it
+};
+struct worker {
+    pthread_t thread;
+    int listen_fd;
+    pthread_mutex_t lock; // sessions, handoffs
+    struct session ** sessions;
+    struct handoff * handoffs;
+    int handoff_fd;
+    int * sessions_open;
+    int * sessions_detached;
+    struct traffic * traffic;
+    struct histogram * latency;
+    struct io_stats * io;
+};
+static struct worker * workers;
+static int nworkers = 1;
+static __thread struct worker * self;
+static __thread struct event handoff_ev;
+static pthread_barrier_t workers_ready; // all struct workers filled in
 
 // server data
-static int sockfd, newsockfd, portnum, clilen;
-struct sockaddr_in serv_addr, cli_addr;
+static __thread int epfd;
+static __thread struct event listen_ev;
+static int portnum;
+struct sockaddr_in serv_addr;
+struct sockaddr_in6 serv_addr6;
+
+// same-host clients (option --unix=<path>), served like TCP ones; all
+// workers wait on the one socket (EPOLLEXCLUSIVE wakes only one)
+static char * unix_path = NULL;
+static int unix_fd = -1;
+static __thread struct event unix_ev;
+
+// set server socket, one per worker
+int server_socket() {
+    // socket code mostly derived from the following tutorial
+    // by Robert Ingalls:
+    // http://www.cs.rpi.edu/~moorthy/Courses/os98/Pgms/socket.html
+
+    // create new socket: IPv6 taking IPv4 clients too, or only IPv4
+    // where the host has no IPv6
+    int sockfd = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    bool ipv6 = sockfd != -1;
+    if (!ipv6) {
+        sockfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    }
+    if (sockfd == -1) {
+        fprintf(stderr, "Error creating socket: %s\n", strerror(errno));
+        exit(1);
+    }
+    int off = 0;
+    if (ipv6 && setsockopt(sockfd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off)) == -1) {
+        fprintf(stderr, "Error clearing IPV6_V6ONLY: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    // allow restarting the server while old connections linger
+    int on = 1;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1) {
+        fprintf(stderr, "Error setting SO_REUSEADDR: %s\n", strerror(errno));
+        exit(1);
+    }
+    // every worker binds the port and gets a share of the clients
+    if (nworkers > 1 && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1) {
+        fprintf(stderr, "Error setting SO_REUSEPORT: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    // set fields of serv_addr
+    bzero((char *)&serv_addr, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_addr.s_addr = INADDR_ANY;
+    serv_addr.sin_port = htons(portnum);
+    bzero((char *)&serv_addr6, sizeof(serv_addr6));
+    serv_addr6.sin6_family = AF_INET6;
+    serv_addr6.sin6_addr = in6addr_any;
+    serv_addr6.sin6_port = htons(portnum);
+
+    // bind socket to address
+    if ((ipv6 ? bind(sockfd, (struct sockaddr*)&serv_addr6, sizeof(serv_addr6)) :
+                bind(sockfd, (struct sockaddr*)&serv_addr, sizeof(serv_addr))) == -1) {
+        fprintf(stderr, "Error binding socket to address: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    // listen for connections, accepted from serve()
+    if (listen(sockfd, SOMAXCONN) == -1) {
+        fprintf(stderr, "Error listening on socket: %s\n", strerror(errno));
+        exit(1);
+    }
+    return sockfd;
+}
+
+// listen on a Unix socket at path, in the abstract namespace for a
+// path starting with '@'. A socket file left by an earlier run is
+// replaced.
+int unix_socket(const char * path) {
+    struct sockaddr_un addr;
+    socklen_t len = unix_address(&addr, path);
+    int sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (sockfd == -1) {
+        fprintf(stderr, "Error creating socket: %s\n", strerror(errno));
+        exit(1);
+    }
+    if (path[0] != '@') {
+        unlink(path);
+    }
+    if (bind(sockfd, (struct sockaddr *)&addr, len) == -1) {
+        fprintf(stderr, "Error binding socket to %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    if (listen(sockfd, SOMAXCONN) == -1) {
+        fprintf(stderr, "Error listening on socket: %s\n", strerror(errno));
+        exit(1);
+    }
+    return sockfd;
+}
+
+void refill_arm();
+
+// the pidfd of a shell became readable: the shell has exited
+void shell_exit_event(struct event * ev, uint32_t events) {
+    (void) events;
+    struct shell_proc * proc = ev->data;
+    int status;
+    if (waitpid(proc->pid, &status, 0) == -1) {
+        fprintf(stderr, "Error with waitpid: %s\n", strerror(errno));
+        exit(1);
+    }
+    int child_exit_signal = WTERMSIG(status);
+    // alternatively use: = 0x007f & status;
+
+    int child_exit_status = WEXITSTATUS(status);
+    // alternatively use:  = (0xff00 & status) >> 8;
+
+    fprintf(stderr, "SHELL EXIT SIGNAL=%d STATUS=%d\n", child_exit_signal, child_exit_status);
+
+    // a shell that died in the pool is dropped from it
+    if (proc->pooled) {
+        struct shell_proc ** p = &shell_pool;
+        while (*p != proc) {
+            p = &(*p)->next_pooled;
+        }
+        *p = proc->next_pooled;
+        shell_pool_len--;
+        close_wrap(proc->forward_fd, 4001);
+        close_wrap(proc->read_fd, 4002);
+        refill_arm();
+    }
+    reactor_del(epfd, ev);
+    close_wrap(ev->fd, 4000);
+    free(proc);
+}
+
+// open a pseudo-terminal: *master for the server, the slave's name
+// for the shell
+char * open_pty(int * master) {
+    *master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (*master == -1 || grantpt(*master) == -1 || unlockpt(*master) == -1) {
+        fprintf(stderr, "Error opening pseudo-terminal: %s\n", strerror(errno));
+        exit(1);
+    }
+    static __thread char name[64];
+    int err = ptsname_r(*master, name, sizeof(name));
+    if (err != 0) {
+        fprintf(stderr, "Error with ptsname: %s\n", strerror(err));
+        exit(1);
+    }
+    return name;
+}
+
+// the shell side of a pty: a new session with the slave as its
+// controlling terminal on fds 0, 1 and 2
+void pty_child(const char * slave_name) {
+    if (setsid() == -1) {
+        fprintf(stderr, "Error with setsid: %s\n", strerror(errno));
+        exit(1);
+    }
+    int slave = open(slave_name, O_RDWR);
+    if (slave == -1 || ioctl(slave, TIOCSCTTY, 0) == -1) {
+        fprintf(stderr, "Error opening %s: %s\n", slave_name, strerror(errno));
+        exit(1);
+    }
+    dup2(slave, 0);
+    dup2(slave, 1);
+    dup2(slave, 2);
+    if (slave > 2) {
+        close_wrap(slave, 9);
+    }
+}
+
+// fork a shell connected with pipes, or with option --pty and pty set,
+// on a pseudo-terminal
+struct shell_proc * spawn_shell(bool pty) {
+    // create pipes
+    int pipe_in[2], pipe_out[2]; // pipes into shell and out of shell
+    int master = -1;
+    char * slave_name = NULL;
+    if (pty) {
+        slave_name = open_pty(&master);
+    }
+    else if (pipe2(pipe_in, O_CLOEXEC) == -1 || pipe2(pipe_out, O_CLOEXEC) == -1) {
+        fprintf(stderr, "Error creating pipe: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    // fork process
+    pid_t pid = fork();
+    if (pid == -1) {
+        fprintf(stderr, "Error forking: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    // child process (shell)
+    if (pid == 0) {
+        // every other fd of the server is close-on-exec, so the shell
+        // only keeps its own pipes
+        signal(SIGPIPE, SIG_DFL);
+        sigprocmask(SIG_UNBLOCK, &stop_signals, NULL);
 
-// handler for SIGPIPE
-// turns received_sigpipe to true which causes term_rw() to stop
-// read-write
-static bool received_sigpipe = false;
-void handler(int sigint) {
-    if (sigint == SIGPIPE) {
-        received_sigpipe = true;
+        if (pty) {
+            pty_child(slave_name);
+            char * args[] = {program, NULL};
+            execvp(*args, args);
+            fprintf(stderr, "Error with execv: %s\n", strerror(errno));
+            exit(1);
+        }
+
+        // make stdin pipe from terminal process
+        close_wrap(0, 0);
+        dup_wrap(pipe_in[READ], 0);
+        close_wrap(pipe_in[READ], 1);
+
+        // make stdout and stderr dups of pipe to terminal
+        close_wrap(1, 2);
+        dup_wrap(pipe_out[WRITE], 2);
+        close_wrap(2, 3);
+        dup_wrap(pipe_out[WRITE], 3);
+        close_wrap(pipe_out[WRITE], 4);
+
+        //close the rest of the pipe file descriptors
+        close_wrap(pipe_in[WRITE], 5);
+        close_wrap(pipe_out[READ], 6);
+
+        // create shell from child process
+        char * args[] = {program, NULL};
+        if (execvp(*args, args) == -1) {
+            fprintf(stderr, "Error with execv: %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+
+    // parent process (terminal)
+    //close pipe fds used by child
+    if (!pty) {
+        close_wrap(pipe_in[READ], 7);
+        close_wrap(pipe_out[WRITE], 8);
+    }
+
+    // wait for the shell to exit through the event loop
+    struct shell_proc * proc = malloc(sizeof(struct shell_proc));
+    if (proc == NULL) {
+        fprintf(stderr, "Error allocating shell: %s\n", strerror(errno));
+        exit(1);
+    }
+    proc->pid = pid;
+    // set read, write file descriptors
+    if (pty) {
+        // two fds for the master, so the session closes them like pipes
+        proc->read_fd = master;
+        proc->forward_fd = fcntl(master, F_DUPFD_CLOEXEC, 0);
+        if (proc->forward_fd == -1) {
+            fprintf(stderr, "Error duplicating pty master: %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+    else {
+        proc->forward_fd = pipe_in[WRITE];
+        proc->read_fd = pipe_out[READ];
+    }
+    proc->pty = pty;
+    proc->pooled = false;
+    proc->ev.fd = syscall(SYS_pidfd_open, pid, 0);
+    if (proc->ev.fd == -1) {
+        fprintf(stderr, "Error opening pidfd: %s\n", strerror(errno));
+        exit(1);
+    }
+    if (fcntl(proc->ev.fd, F_SETFD, FD_CLOEXEC) == -1) {
+        fprintf(stderr, "Error setting FD_CLOEXEC on pidfd: %s\n", strerror(errno));
+        exit(1);
+    }
+    proc->ev.handler = shell_exit_event;
+    proc->ev.data = proc;
+    reactor_add(epfd, &proc->ev, EPOLLIN);
+    return proc;
+}
+
+// start a shell and put it in the pool
+// (pty shells with option --pty, which clients with --pty ask for)
+void shell_pool_add() {
+    struct shell_proc * proc = spawn_shell(pty_allowed);
+    proc->pooled = true;
+    proc->next_pooled = shell_pool;
+    shell_pool = proc;
+    shell_pool_len++;
+}
+
+// run the refill timer while the pool is short, stop it once full
+void refill_arm() {
+    bool short_of_shells = shell_pool_len < shell_pool_size;
+    if (short_of_shells == refill_armed) {
+        return;
+    }
+    struct itimerspec its = {{0, 0}, {0, 0}};
+    if (short_of_shells) {
+        its.it_interval.tv_sec = 1 / shell_pool_rate;
+        its.it_interval.tv_nsec = 1000000000L / shell_pool_rate % 1000000000L;
+        its.it_value = its.it_interval;
+    }
+    if (timerfd_settime(refill_ev.fd, 0, &its, NULL) == -1) {
+        fprintf(stderr, "Error setting refill timer: %s\n", strerror(errno));
+        exit(1);
+    }
+    refill_armed = short_of_shells;
+}
+
+// refill timer tick: one more shell for the pool
+void refill_event(struct event * ev, uint32_t events) {
+    (void) events;
+    uint64_t ticks;
+    if (read(ev->fd, &ticks, sizeof(ticks)) == -1 && errno != EAGAIN) {
+        fprintf(stderr, "Error reading refill timer: %s\n", strerror(errno));
+        exit(1);
+    }
+    if (shell_pool_len < shell_pool_size) {
+        shell_pool_add();
+    }
+    refill_arm();
+}
+
+// fill the pool at startup and set up its refill timer
+void shell_pool_start() {
+    refill_ev.fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (refill_ev.fd == -1) {
+        fprintf(stderr, "Error creating refill timer: %s\n", strerror(errno));
+        exit(1);
+    }
+    refill_ev.handler = refill_event;
+    reactor_add(epfd, &refill_ev, EPOLLIN);
+    while (shell_pool_len < shell_pool_size) {
+        shell_pool_add();
+    }
+}
+
+// give session s a shell, from the pool if one of the right kind is
+// waiting there
+void session_shell(struct session * s) {
+    struct shell_proc * proc = shell_pool;
+    if (proc != NULL && proc->pty == s->pty) {
+        shell_pool = proc->next_pooled;
+        shell_pool_len--;
+        proc->pooled = false;
+        refill_arm();
+    }
+    else {
+        proc = spawn_shell(s->pty);
+    }
+    s->child_pid = proc->pid;
+    s->forward_fd = proc->forward_fd;
+    s->shell_ev.fd = proc->read_fd;
+    s->forward_fd_open = true;
+    s->read_fd_open = true;
+}
+
+// mark a session as ended, it is closed once the current batch of
+// events has been handled. The channels of a connection end with it.
+void session_end(struct session * s) {
+    if (!s->shutdown) {
+        s->shutdown = true;
+        s->next_closing = closing;
+        closing = s;
+        if (s->channels != NULL) {
+            int i;
+            for (i = 1; i < CHANNEL_MAX; i++) {
+                if (s->channels[i] != NULL) {
+                    session_end(s->channels[i]);
+                }
+            }
+        }
+    }
+}
+
+// count traffic of session s in direction dir
+void traffic_add(struct session * s, int dir, size_t data, size_t wire, int frames) {
+    s->traffic[dir].data += data;
+    s->traffic[dir].wire += wire;
+    s->traffic[dir].frames += frames;
+    traffic[dir].data += data;
+    traffic[dir].wire += wire;
+    traffic[dir].frames += frames;
+}
+
+// time since start (from now_ns(), 0 without --metrics) into the
+// latency histogram of direction dir
+void latency_add(int dir, uint64_t start) {
+    if (metrics_set) {
+        histogram_add(&latency[dir], now_ns() - start);
+    }
+}
+
+// look at session s after every pass of the event loop (io_uring)
+void session_wait(struct session * s) {
+    if (io_uring_on && !s->waiting) {
+        s->waiting = true;
+        s->next_waiting = waiting;
+        waiting = s;
+    }
+}
+
+void shell_resume(struct session * s);
+
+// the detach timer of session s ran out before its client came back
+void detach_event(struct event * ev, uint32_t events) {
+    (void) events;
+    session_end(ev->data);
+}
+
+// drop the socket of detachable session c and what goes with it
+void client_close(struct session * c) {
+    reactor_del(epfd, &c->sock_ev);
+    shutdown(c->sock_ev.fd, SHUT_RDWR);
+    close_wrap(c->sock_ev.fd, 3001);
+    c->sock_ev.fd = -1;
+    outq_free(&c->to_client);
+    codec_end(&c->codec);
+    codec_init(&c->codec, CODEC_NONE, 0, 0);
+    frame_reader_free(&c->in);
+    c->read_paused = false;
+}
+
+// the client of detachable session c is lost: close the socket and
+// keep the shell running until the client resumes or detach_timeout
+// seconds passed
+void session_detach(struct session * c) {
+    client_close(c);
+    c->detach_ev.fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (c->detach_ev.fd == -1) {
+        fprintf(stderr, "Error creating detach timer: %s\n", strerror(errno));
+        exit(1);
+    }
+    struct itimerspec its = {{0, 0}, {detach_timeout, 0}};
+    if (timerfd_settime(c->detach_ev.fd, 0, &its, NULL) == -1) {
+        fprintf(stderr, "Error setting detach timer: %s\n", strerror(errno));
+        exit(1);
+    }
+    c->detach_ev.handler = detach_event;
+    c->detach_ev.data = c;
+    reactor_add(epfd, &c->detach_ev, EPOLLIN);
+    c->detached = true;
+    sessions_detached++;
+    // output that waited for the client now only goes to the scrollback
+    shell_resume(c);
+}
+
+// the client of connection c is gone: a detachable session waits for
+// it to come back, any other one ends
+void client_lost(struct session * c) {
+    c->lost = true;
+    if (c->detachable && !c->shutdown) {
+        session_detach(c);
+    }
+    else {
+        session_end(c);
+    }
+}
+
+// write to the client of connection c; what the socket does not take
+// is queued
+void client_write(struct session * c, const void * buf, size_t nbyte) {
+    if (c->lost) {
+        return;
+    }
+    if (outq_write(&c->to_client, c->sock_ev.fd, buf, nbyte, "to client") == -1) {
+        client_lost(c);
+    }
+}
+
+// send a CTRL_OPEN, CTRL_CLOSE or CTRL_WINDOW for the channel of
+// session s to its client
+void channel_send(struct session * s, int type, uint32_t value) {
+    unsigned char frame[FRAME_CHANNEL_SIZE];
+    int frame_bytes = frame_channel_ctrl(frame, s->channel, type, value);
+    traffic_add(s, TO_CLIENT, 0, frame_bytes, 1);
+    client_write(s->conn, frame, frame_bytes);
+}
+
+// close the shell's input, dropping what it did not read
+void forward_close(struct session * s) {
+    reactor_del(epfd, &s->forward_ev);
+    close_wrap(s->forward_fd, 1000);
+    s->forward_fd_open = false;
+    s->forward_eof = false;
+    outq_free(&s->to_shell);
+}
+
+// close everything a session holds. The shell sees EOF on its input and
+// is reaped by shell_exit_event() once it exits. Output still queued
+// for a client that is there is written first: the session stays in
+// draining until then.
+void session_close(struct session * s) {
+    // no client resumes it from now on; one that is there learns that
+    // the session is over
+    if (s->detachable) {
+        pthread_mutex_lock(&tokens_lock);
+        struct session ** t = &tokens;
+        while (*t != s) {
+            t = &(*t)->next_token;
+        }
+        *t = s->next_token;
+        pthread_mutex_unlock(&tokens_lock);
+        s->detachable = false;
+        if (!s->lost) {
+            channel_send(s, CTRL_CLOSE, 0);
+        }
+    }
+    if (s->detached) {
+        reactor_del(epfd, &s->detach_ev);
+        close_wrap(s->detach_ev.fd, 3002);
+        s->detached = false;
+        sessions_detached--;
+    }
+    free(s->scrollback.buf);
+    s->scrollback.buf = NULL;
+    if (s->forward_fd_open) {
+        forward_close(s);
+    }
+    if (s->read_fd_open) {
+        reactor_del(epfd, &s->shell_ev);
+        close_wrap(s->shell_ev.fd, 2000);
+        s->read_fd_open = false;
+    }
+    if (s->conn == s && !s->lost && outq_pending(&s->to_client, s->sock_ev.fd) > 0) {
+        s->draining = true;
+        session_wait(s);
+        return;
+    }
+    if (s->waiting) {
+        struct session ** w = &waiting;
+        while (*w != s) {
+            w = &(*w)->next_waiting;
+        }
+        *w = s->next_waiting;
+    }
+    if (s->conn != s) {
+        // a channel: the client learns it is closed while the
+        // connection lasts
+        if (s->conn != NULL) {
+            s->conn->channels[s->channel] = NULL;
+            if (!s->conn->shutdown) {
+                channel_send(s, CTRL_CLOSE, 0);
+            }
+        }
+    }
+    else {
+        // channels still waiting to be closed lose their connection
+        if (s->channels != NULL) {
+            int i;
+            for (i = 1; i < CHANNEL_MAX; i++) {
+                if (s->channels[i] != NULL) {
+                    s->channels[i]->conn = NULL;
+                }
+            }
+            free(s->channels);
+        }
+        //close connection to socket, unless it was detached or handed on
+        if (s->sock_ev.fd != -1) {
+            reactor_del(epfd, &s->sock_ev);
+            shutdown(s->sock_ev.fd, SHUT_RDWR);
+            close_wrap(s->sock_ev.fd, 3000);
+        }
+        outq_free(&s->to_client);
+        codec_end(&s->codec);
+        frame_reader_free(&s->in);
+    }
+    pthread_mutex_lock(&self->lock);
+    if (s->prev != NULL) {
+        s->prev->next = s->next;
+    }
+    else {
+        sessions = s->next;
+    }
+    if (s->next != NULL) {
+        s->next->prev = s->prev;
+    }
+    sessions_open--;
+    pthread_mutex_unlock(&self->lock);
+    free(s);
+}
+
+// keep nbyte bytes of output at the end of scrollback sb
+void scrollback_add(struct scrollback * sb, const char * buf, size_t nbyte) {
+    if (nbyte > sb->size) {
+        buf += nbyte - sb->size;
+        sb->seq += nbyte - sb->size;
+        nbyte = sb->size;
+    }
+    size_t pos = sb->seq % sb->size;
+    size_t first = sb->size - pos < nbyte ? sb->size - pos : nbyte;
+    memcpy(sb->buf + pos, buf, first);
+    memcpy(sb->buf, buf + first, nbyte - first);
+    sb->seq += nbyte;
+}
+
+// send nbyte bytes of data to the client of session s, in a frame on
+// the session's channel unless the client talks plain bytes. A lost
+// client ends the connection (or detaches the session). A detachable
+// session keeps the bytes in its scrollback even without a client.
+void client_send(struct session * s, char * buf, size_t nbyte) {
+    struct session * c = s->conn;
+    if (s->detachable) {
+        scrollback_add(&s->scrollback, buf, nbyte);
+    }
+    if (c->lost) {
+        return;
+    }
+    if (c->proto == PROTO_FRAMED) {
+        char * frame = pool_get(FRAME_BOUND(nbyte));
+        int frame_bytes = frame_compress(&c->codec, frame, buf, nbyte);
+        frame_channel(frame, s->channel);
+        traffic_add(s, TO_CLIENT, nbyte, frame_bytes, 1);
+        client_write(c, frame, frame_bytes);
+        pool_put(frame);
+    }
+    else {
+        traffic_add(s, TO_CLIENT, nbyte, nbyte, 0);
+        client_write(c, buf, nbyte);
+    }
+    s->window -= nbyte;
+}
+
+// give the client credit for the input of channel s that was passed on,
+// unless the shell is behind with reading it
+void channel_credit(struct session * s) {
+    if (s->unacked >= CHANNEL_WINDOW / 2 &&
+        (!s->forward_fd_open || outq_pending(&s->to_shell, s->forward_fd) < OUTQ_LOW)) {
+        channel_send(s, CTRL_WINDOW, s->unacked);
+        s->unacked = 0;
+    }
+}
+
+// KEYBOARD WRITE
+// forward a run of nbyte client bytes without control characters to
+// the shell. A closed shell (EPIPE) ends the session; one that does not
+// keep up stops its client from being read (with HELLO_MUX the
+// channel's credit stops instead, see channel_credit()).
+void forward_run (struct session * s, char * run, int nbyte) {
+    if (nbyte > 0 && forwarding && s->forward_fd_open && !s->forward_eof) {
+        if (outq_write(&s->to_shell, s->forward_fd, run, nbyte, "to shell") == -1) {
+            forward_close(s);
+            session_end(s);
+            return;
+        }
+        if (!s->conn->mux && outq_pending(&s->to_shell, s->forward_fd) >= OUTQ_HIGH) {
+            s->read_paused = true;
+            session_wait(s);
+        }
+    }
+}
+
+// reading and writing with additional conditions
+// handles rcount bytes (already decompressed) read from the client
+// of session arg
+void term_rw (void * arg, char * buf, int rcount) {
+    struct session * s = arg;
+    bool escape = false;
+
+    if (record_set) {
+        log_record(&recorder, LOG_SENT, s->id, buf, rcount);
+        if (!forwarding) {
+            log_record(&recorder, LOG_RECEIVED, s->id, buf, rcount);
+        }
+    }
+
+    /*
+
+     no option write back to client
+
+     */
+
+    traffic_add(s, TO_SHELL, rcount, 0, 0);
+    if (!forwarding) {
+        client_send(s, buf, rcount);
+        // a client that does not read its echo is not read either
+        if (outq_pending(&s->to_client, s->sock_ev.fd) >= OUTQ_HIGH) {
+            s->read_paused = true;
+            session_wait(s);
+        }
+    }
+    // the client may send as much again once the shell has it
+    if (s->conn->mux) {
+        s->unacked += rcount;
+        channel_credit(s);
+    }
+
+    // on a pty the terminal driver handles <cr>, ^C and ^D itself
+    if (s->pty) {
+        forward_run(s, buf, rcount);
+        return;
+    }
+
+    /*                     KEYBOARD
+     *           CHECK FOR SPECIAL CHARACTERS
+     *                       and
+     * -------------------- WRITE -------------------- *
+     */
+    // Everything between two control characters is forwarded to the
+    // shell with one write; <cr> is mapped to <lf> in place first.
+    //
+    // KEYBOARD WRITE
+    // <cr> or <lf> mapping: to shell, only <lf>
+    map_cr_lf(buf, rcount);
+    int run = 0; // start of the run not yet forwarded
+    int i = 0;
+    while ((i += scan_special(buf + i, rcount - i, SCAN_ETX | SCAN_EOT)) < rcount) {
+        forward_run(s, buf + run, i - run);
+        run = i + 1;
+        switch (buf[i])
+        {
+                // CLIENT escape sequence check
+                //
+                //  1) check for escape sequence -- 0x04 is hex for ^D escape sequence
+                //     (no --shell option)
+                //  2) check for ^C (0x03), use kill(2) to send SIGINT to shell process
+                //  3) close pipe to shell if receive ^D (0x04)
+            case 0x04: // ^D
+                if (!forwarding) { escape = true; break; }
+                // after the input before it
+                if (s->forward_fd_open && outq_pending(&s->to_shell, s->forward_fd) > 0) {
+                    s->forward_eof = true;
+                    session_wait(s);
+                }
+                else if (s->forward_fd_open) {
+                    forward_close(s);
+                }
+                break;
+            case 0x03: // ^C
+                if (forwarding) {
+                    // the input before ^C gets one try at the shell;
+                    // the signal does not wait for the rest: a shell
+                    // that does not read is what ^C is for
+                    if (s->forward_fd_open) {
+                        outq_flush(&s->to_shell, s->forward_fd, "to shell");
+                    }
+                    // the shell may already be gone (ESRCH)
+                    if (kill(s->child_pid, SIGINT)==-1 && errno != ESRCH) {
+                        fprintf(stderr, "Error with kill: %s\n", strerror(errno));
+                        exit(1);
+                    }
+                }
+                break;
+        }
+        i++;
+    }
+    forward_run(s, buf + run, rcount - run);
+
+    // stop when no --shell option due to ^D
+    // look at "KEYBOARD escape sequence check" 1)
+    if (escape) {
+        session_end(s);
+    }
+}
+
+void shell_event(struct event * ev, uint32_t events);
+void session_drained(struct session * s);
+
+// the shell's input has room again (edge-triggered)
+void forward_event(struct event * ev, uint32_t events) {
+    (void) events;
+    struct session * s = ev->data;
+    if (outq_flush(&s->to_shell, ev->fd, "to shell") == -1) {
+        forward_close(s);
+        session_end(s);
+        return;
+    }
+    session_drained(s);
+}
+
+// start the shell of session s and watch its output, and its input
+// for room
+void session_shell_start(struct session * s) {
+    session_shell(s);
+    s->shell_ev.handler = shell_event;
+    s->shell_ev.data = s;
+    set_nonblock(s->shell_ev.fd);
+    reactor_add(epfd, &s->shell_ev, EPOLLIN | EPOLLET);
+    s->forward_ev.fd = s->forward_fd;
+    s->forward_ev.handler = forward_event;
+    s->forward_ev.data = s;
+    set_nonblock(s->forward_fd);
+    reactor_add(epfd, &s->forward_ev, EPOLLOUT | EPOLLET);
+}
+
+// make detachable session s known by a new token and tell its client
+void session_token(struct session * s) {
+    if (getrandom(s->token, TOKEN_SIZE, 0) != TOKEN_SIZE) {
+        fprintf(stderr, "Error with getrandom: %s\n", strerror(errno));
+        exit(1);
+    }
+    s->scrollback.buf = malloc(scrollback_size);
+    if (s->scrollback.buf == NULL) {
+        fprintf(stderr, "Error allocating scrollback: %s\n", strerror(errno));
+        exit(1);
+    }
+    s->scrollback.size = scrollback_size;
+    s->owner = self;
+    s->no_splice = true; // the output is copied into the scrollback
+    pthread_mutex_lock(&tokens_lock);
+    s->next_token = tokens;
+    tokens = s;
+    pthread_mutex_unlock(&tokens_lock);
+    unsigned char token[FRAME_TOKEN_SIZE];
+    traffic_add(s, TO_CLIENT, 0, FRAME_TOKEN_SIZE, 1);
+    client_write(s, token, frame_token(token, s->token, 0));
+}
+
+// the client of connection s resumes detachable session d (of this
+// worker), offset data bytes after the start of its output: d takes
+// over the socket and answers the HELLO with the codec agreed, then
+// sends the output the client missed as far as the scrollback has it.
+// A client still attached to d has left that connection.
+void session_attach(struct session * d, struct session * s, int codec, int level,
+                    uint32_t dict, uint64_t offset) {
+    if (d->detached) {
+        reactor_del(epfd, &d->detach_ev);
+        close_wrap(d->detach_ev.fd, 3002);
+        d->detached = false;
+        sessions_detached--;
+    }
+    else {
+        client_close(d);
+    }
+    reactor_del(epfd, &s->sock_ev);
+    d->sock_ev.fd = s->sock_ev.fd;
+    s->sock_ev.fd = -1;
+    s->lost = true;
+    reactor_add(epfd, &d->sock_ev, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+    d->in = s->in;
+    frame_reader_init(&s->in);
+    d->lost = false;
+    codec_init(&d->codec, codec, level, dict != 0);
+
+    unsigned char hello[FRAME_HELLO_SIZE];
+    uint8_t flags = HELLO_DETACH | HELLO_RESUME | (d->pty ? HELLO_PTY : 0);
+    client_write(d, hello, frame_hello(hello, codec, level, dict, flags));
+    struct scrollback * sb = &d->scrollback;
+    uint64_t kept = sb->seq < sb->size ? sb->seq : sb->size;
+    if (offset < sb->seq - kept || offset > sb->seq) {
+        offset = sb->seq - kept;
+    }
+    unsigned char token[FRAME_TOKEN_SIZE];
+    traffic_add(d, TO_CLIENT, 0, FRAME_TOKEN_SIZE, 1);
+    client_write(d, token, frame_token(token, d->token, offset));
+    // what the client missed, in frames of up to FRAME_BURST bytes
+    // that do not wrap around the end of the scrollback
+    while (offset < sb->seq && !d->lost) {
+        size_t pos = offset % sb->size;
+        size_t nbyte = sb->size - pos;
+        if (nbyte > sb->seq - offset) {
+            nbyte = sb->seq - offset;
+        }
+        if (nbyte > FRAME_BURST) {
+            nbyte = FRAME_BURST;
+        }
+        char * frame = pool_get(FRAME_BOUND(nbyte));
+        int frame_bytes = frame_compress(&d->codec, frame, sb->buf + pos, nbyte);
+        traffic_add(d, TO_CLIENT, nbyte, frame_bytes, 1);
+        client_write(d, frame, frame_bytes);
+        pool_put(frame);
+        offset += nbyte;
+    }
+}
+
+void client_frames(struct session * s, char * inflate_buf);
+
+// a client on connection s resumes the session of token: the worker
+// that has it takes the socket, with the frames read after the HELLO.
+// Returns -1 once s has handed its client on, 0 if no session has the
+// token.
+int session_resume(struct session * s, struct frame * f, const unsigned char * token,
+                   int codec, int level, uint32_t dict, uint64_t offset) {
+    pthread_mutex_lock(&tokens_lock);
+    struct session * d = tokens;
+    while (d != NULL && memcmp(d->token, token, TOKEN_SIZE) != 0) {
+        d = d->next_token;
+    }
+    struct worker * owner = d != NULL ? d->owner : NULL;
+    pthread_mutex_unlock(&tokens_lock);
+    if (owner == NULL) {
+        return 0;
+    }
+    if (owner == self) {
+        if (d->shutdown) {
+            return 0; // its shell just exited
+        }
+        session_attach(d, s, codec, level, dict, offset);
+        shell_resume(d);
+        // no EPOLLIN comes for what was read along with the HELLO
+        char * inflate_buf = pool_get(buf_size);
+        client_frames(d, inflate_buf);
+        pool_put(inflate_buf);
+        return -1;
+    }
+    // the owner answers the HELLO again, it may have closed d by then
+    size_t hello_len = FRAME_HDR_SIZE + f->len;
+    size_t rest = s->in.end - s->in.start;
+    struct handoff * h = malloc(sizeof(struct handoff) + hello_len + rest);
+    if (h == NULL) {
+        fprintf(stderr, "Error allocating handoff: %s\n", strerror(errno));
+        exit(1);
+    }
+    memcpy(h->in, f->payload - FRAME_HDR_SIZE, hello_len);
+    if (rest > 0) {
+        memcpy(h->in + hello_len, s->in.buf + s->in.start, rest);
+    }
+    h->len = hello_len + rest;
+    reactor_del(epfd, &s->sock_ev);
+    h->fd = s->sock_ev.fd;
+    s->sock_ev.fd = -1;
+    s->lost = true;
+    pthread_mutex_lock(&owner->lock);
+    h->next = owner->handoffs;
+    owner->handoffs = h;
+    pthread_mutex_unlock(&owner->lock);
+    uint64_t one = 1;
+    if (write(owner->handoff_fd, &one, sizeof(one)) == -1) {
+        fprintf(stderr, "Error waking worker: %s\n", strerror(errno));
+        exit(1);
+    }
+    return -1;
+}
+
+// the first bytes from the client decide the protocol of session s:
+// a HELLO frame is answered with the codec picked for the session,
+// anything else makes it a plain session. The shell is started once
+// that is known, on a pty if the client asked for one. A HELLO that
+// resumes a detached session hands the client to it instead. Returns
+// -1 if the session must end, 0 once the protocol is known or more
+// bytes are needed.
+int session_start(struct session * s) {
+    struct frame f;
+    int codec, level;
+    uint8_t mask, flags;
+    uint32_t dict;
+    unsigned char token[TOKEN_SIZE];
+    uint64_t offset;
+
+    if (s->in.buf[s->in.start] == FRAME_MAGIC) {
+        int status = frame_next(&s->in, &f);
+        if (status != 1) {
+            return status;
+        }
+        if (hello_parse(&f, &codec, &level, &mask, &dict, &flags) == -1) {
+            fprintf(stderr, "Error with handshake: first frame is not a HELLO\n");
+            return -1;
+        }
+        codec = codec_choose(server_codec, server_level, codec, level, mask, &level);
+        // the preset dictionary only if the client has the same one
+        if (dict != dict_id() || codec == CODEC_NONE) {
+            dict = 0;
+        }
+        if (detach_timeout > 0 && forwarding && hello_resume_parse(&f, token, &offset) == 0 &&
+            session_resume(s, &f, token, codec, level, dict, offset) == -1) {
+            return -1;
+        }
+        codec_init(&s->codec, codec, level, dict != 0);
+        s->pty = (flags & HELLO_PTY) && pty_allowed && forwarding;
+        s->mux = (flags & HELLO_MUX) && forwarding;
+        // the channels of a connection end with it
+        s->detachable = (flags & HELLO_DETACH) && detach_timeout > 0 && forwarding && !s->mux;
+        flags = (s->pty ? HELLO_PTY : 0) | (s->mux ? HELLO_MUX : 0) |
+                (s->detachable ? HELLO_DETACH : 0);
+        unsigned char hello[FRAME_HELLO_SIZE];
+        client_write(s, hello, frame_hello(hello, codec, level, dict, flags));
+        if (s->detachable) {
+            session_token(s);
+        }
+        if (s->lost) {
+            return -1;
+        }
+        // control frames need framing even without compression
+        s->proto = codec == CODEC_NONE && !s->pty && !s->mux && !s->detachable ?
+                   PROTO_RAW : PROTO_FRAMED;
+        if (s->mux) {
+            s->channels = calloc(CHANNEL_MAX, sizeof(struct session *));
+            if (s->channels == NULL) {
+                fprintf(stderr, "Error allocating channels: %s\n", strerror(errno));
+                exit(1);
+            }
+            s->channels[0] = s;
+            s->window = CHANNEL_WINDOW;
+        }
+    }
+    else {
+        s->proto = PROTO_RAW;
+    }
+    if (forwarding) {
+        session_shell_start(s);
+    }
+    // plain bytes that came along are keyboard input
+    if (s->proto == PROTO_RAW) {
+        if (s->in.end > s->in.start) {
+            term_rw(s, (char *)s->in.buf + s->in.start, s->in.end - s->in.start);
+        }
+        frame_reader_free(&s->in);
+    }
+    // send what the shell printed in the meantime
+    if (forwarding && !s->shutdown) {
+        shell_event(&s->shell_ev, EPOLLIN);
+    }
+    return 0;
+}
+
+struct session * session_new();
+void client_event(struct event * ev, uint32_t events);
+
+// restart the output of shell s once its window is open and the
+// client's queue drained
+void shell_resume(struct session * s) {
+    struct session * c = s->conn;
+    if (s->stalled && !s->shutdown && (!c->mux || s->window > 0) &&
+        outq_pending(&c->to_client, c->sock_ev.fd) < OUTQ_LOW) {
+        s->stalled = false;
+        shell_event(&s->shell_ev, EPOLLIN);
+    }
+}
+
+// the queues of session s may have drained: restart what was paused
+// for them
+void session_drained(struct session * s) {
+    struct session * c = s->conn;
+    if (c == NULL) {
+        return;
+    }
+    if (s->forward_fd_open) {
+        size_t to_shell = outq_pending(&s->to_shell, s->forward_fd);
+        if (s->forward_eof && to_shell == 0) {
+            forward_close(s); // ^D after the input before it
+        }
+        else if (c->mux && to_shell < OUTQ_LOW) {
+            channel_credit(s);
+        }
+    }
+    size_t to_client = outq_pending(&c->to_client, c->sock_ev.fd);
+    if (c->draining) {
+        if (c->lost || to_client == 0) {
+            c->draining = false;
+            c->next_closing = closing;
+            closing = c;
+        }
+        else {
+            session_wait(c);
+        }
+        return;
+    }
+    if (c->shutdown) {
+        return;
+    }
+    // the shells that stopped for the client
+    if (to_client < OUTQ_LOW) {
+        int i;
+        for (i = 0; i < (c->mux ? CHANNEL_MAX : 1); i++) {
+            struct session * ch = c->mux ? c->channels[i] : c;
+            if (ch != NULL) {
+                shell_resume(ch);
+            }
+        }
+    }
+    // the client, once its shell (or, echoing, the client itself)
+    // caught up
+    if (c->read_paused && !c->shutdown &&
+        (forwarding ? !c->forward_fd_open || outq_pending(&c->to_shell, c->forward_fd) < OUTQ_LOW
+                    : to_client < OUTQ_LOW)) {
+        c->read_paused = false;
+        client_event(&c->sock_ev, EPOLLIN);
+    }
+    if (s->forward_eof || s->stalled || c->read_paused) {
+        session_wait(s);
     }
 }
 
-// set server socket
-void server_socket() {
-    // socket code mostly derived from the following tutorial
-    // by Robert Ingalls:
-    // http://www.cs.rpi.edu/~moorthy/Courses/os98/Pgms/socket.html
-    
-    // create new socket
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd == -1) {
-        fprintf(stderr, "Error creating socket: %s\n", strerror(errno));
-        exit(1);
+// the client opens channel ch of connection c with the HELLO_* flags
+// asked for: a session with its own shell, confirmed with a CTRL_OPEN
+void channel_open(struct session * c, uint8_t ch, uint32_t flags) {
+    struct session * s = session_new();
+    s->conn = c;
+    s->channel = ch;
+    s->proto = PROTO_FRAMED;
+    s->no_splice = true; // output shares the socket with the other channels
+    s->pty = (flags & HELLO_PTY) && pty_allowed;
+    s->window = CHANNEL_WINDOW;
+    c->channels[ch] = s;
+    channel_send(s, CTRL_OPEN, s->pty ? HELLO_PTY : 0);
+    session_shell_start(s);
+}
+
+// a control frame from client connection c: window size changes of a
+// pty and, with HELLO_MUX, the channels and their flow control
+void session_control(struct session * c, struct frame * f) {
+    struct session * s = c->mux ? c->channels[f->channel] : c;
+    int rows, cols;
+    uint32_t value;
+    if (winsize_parse(f, &rows, &cols) == 0) {
+        if (s != NULL && s->pty && s->read_fd_open) {
+            struct winsize ws = {rows, cols, 0, 0};
+            // the shell gets SIGWINCH from the terminal driver
+            if (ioctl(s->shell_ev.fd, TIOCSWINSZ, &ws) == -1) {
+                fprintf(stderr, "Error setting window size: %s\n", strerror(errno));
+            }
+        }
+        return;
     }
-    
-    // set fields of serv_addr
-    bzero((char *)&serv_addr, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_addr.s_addr = INADDR_ANY;
-    serv_addr.sin_port = htons(portnum);
-    
-    // bind socket to address
-    if (bind(sockfd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) == -1) {
-        fprintf(stderr, "Error binding socket to address: %s\n", strerror(errno));
-        exit(1);
+    if (!c->mux) {
+        return;
     }
-    
-    // listen for connections
-    listen(sockfd, 5);
-    
-    // block until client connects to server
-    clilen = sizeof(cli_addr);
-    newsockfd = accept(sockfd, (struct sockaddr*)&cli_addr, (socklen_t*)&clilen);
-    if(newsockfd == -1) {
-        fprintf(stderr, "Error establishing connection with client: %s\n", strerror(errno));
-        exit(1);
+    switch (channel_ctrl_parse(f, &value)) {
+        case CTRL_OPEN:
+            if (s == NULL) {
+                channel_open(c, f->channel, value);
+            }
+            break;
+        case CTRL_CLOSE:
+            // channel 0 lasts as long as the connection
+            if (s != NULL && s != c) {
+                session_end(s);
+            }
+            break;
+        case CTRL_WINDOW:
+            if (s != NULL) {
+                s->window += value;
+                shell_resume(s);
+            }
+            break;
     }
 }
 
-// reading and writing with additional conditions
-void term_rw (bool forwarding, bool compress_set) {
-    size_t buf_size = 256*2;
-    char buf[buf_size];
-    char buf_shellin[buf_size];
-    int rcount, rcount_shellin;
-    bool escape = false;
-    char lf[] = {0x0A};
-    bool forward_fd_open = true;
-    bool read_fd_open = true;
-    bool shutdown = false;
-    
-    char tmp_buf[buf_size];
-    int def_bytes;
-    
-    while(1){
-        /*
-         * -------------------- POLL -------------------- *
-         */
-        
-        // poll for option --shell
-        if (forwarding) {
-            if (poll(fds, 2, 0) == -1) {
-                fprintf(stderr, "Error polling: %s\n", strerror(errno));
-                exit(1);
-            }
+// data for a channel that is already closed; decoded all the same to
+// keep the codec stream in step
+void discard (void * arg, char * buf, int nbyte) {
+    (void) arg;
+    (void) buf;
+    (void) nbyte;
+}
+
+// every complete frame received so far from the client of connection
+// s; one that cannot be decoded ends the session
+void client_frames(struct session * s, char * inflate_buf) {
+    struct frame f;
+    int status = 0;
+    while (!s->shutdown && !s->lost && (status = frame_next(&s->in, &f)) == 1) {
+        if (f.flags & FRAME_CONTROL) {
+            traffic_add(s, TO_SHELL, 0, 0, 1);
+            session_control(s, &f);
+            continue;
+        }
+        struct session * ch = s->mux ? s->channels[f.channel] : s;
+        traffic_add(ch != NULL ? ch : s, TO_SHELL, 0, 0, 1);
+        if (frame_decode(&s->codec, &f, inflate_buf, buf_size,
+                         ch != NULL ? term_rw : discard, ch) == -1) {
+            status = -1;
+            break;
+        }
+    }
+    if (status == -1) {
+        session_end(s);
+    }
+}
+
+// the client socket is ready (edge-triggered): write what is queued for
+// it, and read until EAGAIN (or until a queue is full)
+void client_event(struct event * ev, uint32_t events) {
+    struct session * s = ev->data;
+    if (events & EPOLLOUT) {
+        if (!s->lost && outq_flush(&s->to_client, ev->fd, "to client") == -1) {
+            client_lost(s);
         }
-        
+        session_drained(s);
+    }
+    char * buf = pool_get(buf_size);
+    char * inflate_buf = pool_get(buf_size);
+    int rcount;
+
+    while (!s->shutdown && !s->lost && !s->read_paused) {
         /*
          * -------------------- READ -------------------- *
          */
-        
-        // read from client
-        // for option --shell, only read if POLLIN in revents
-        rcount = -1;
-        if (!forwarding || fds[0].revents & POLLIN) {
-            rcount = read_wrap(newsockfd, buf, buf_size, "from client [1]");
-        }
-        
-        // for option --shell, read from shell
-        rcount_shellin = -1;
-        if (forwarding) {
-            if (fds[1].revents & POLLIN) {
-                rcount_shellin = read_wrap(read_fd, buf_shellin, buf_size, "from shell [1]");
-            }
+        if (s->proto != PROTO_RAW) {
+            rcount = frame_read(&s->in, ev->fd, buf_size, "from client [1]");
         }
-        /*
-         DEAL WITH COMPRESSION
-         */
-        if (compress_set) {
-            if (rcount > 0) {
-                rcount = zdecompress_old(buf, rcount, buf_size);
-            }
+        else {
+            rcount = read_peer(ev->fd, buf, buf_size, "from client [1]");
+        }
+        if (rcount == -1) {
+            break; // EAGAIN, everything read
+        }
+        uint64_t start = metrics_set ? now_ns() : 0;
+        if (rcount > 0) {
+            traffic_add(s, TO_SHELL, 0, rcount, 0);
         }
         /*
          * -------------------- shutdown check -------------------- *
          */
-        
-        // if EOF or polling-error from shell, shut down
-        if (forwarding) {
-            if (rcount_shellin == 0 ||
-                fds[1].revents & POLLHUP ||
-                fds[1].revents & POLLERR) {
-                
-                shutdown = true;
+        // EOF or error from client
+        if (rcount == 0) {
+            client_lost(s);
+            break;
+        }
+        // HANDSHAKE
+        if (s->proto == PROTO_UNKNOWN) {
+            if (session_start(s) == -1) {
+                session_end(s);
+                break;
             }
-            if (rcount == 0 ||
-                fds[0].revents & POLLHUP ||
-                fds[0].revents & POLLERR) {
-                
-                shutdown = true;
+            if (s->proto != PROTO_FRAMED) {
+                continue;
             }
         }
-        
         /*
-         
-         no option write back to client
-         
+         DEAL WITH COMPRESSION
          */
-        
-        if (!forwarding && rcount > 0) {
-            if (compress_set) {
-                zcompress(newsockfd, buf, rcount, buf_size);
-            }
-            else {
-                write_wrap(newsockfd, buf, rcount, "to client");
-            }
+        if (s->proto == PROTO_RAW) {
+            term_rw(s, buf, rcount);
+            latency_add(TO_SHELL, start);
+            continue;
         }
-        
-        /*                     KEYBOARD
-         *           CHECK FOR SPECIAL CHARACTERS
-         *                       and
-         * -------------------- WRITE -------------------- *
-         */
-        char c;
-        int i;
-        for (i = 0; i < rcount; i++) {
-            c = buf[i];
-            switch (c)
-            {
-                    // CLIENT escape sequence check
-                    //
-                    //  1) check for escape sequence -- 0x04 is hex for ^D escape sequence
-                    //     (no --shell option)
-                    //  2) check for ^C (0x03), use kill(2) to send SIGINT to shell process
-                    //  3) close pipe to shell if receive ^D (0x04)
-                case 0x04: // ^D
-                    if (!forwarding) { escape = true; break; }
-                    if (forwarding) {
-                        close_wrap(forward_fd, 20);
-                        forward_fd_open = false;
-                    }
-                    break;
-                case 0x03: // ^C
-                    if (forwarding) {
-                        if (kill(child_pid, SIGINT)==-1) {
-                            fprintf(stderr, "Error with kill: %s\n", strerror(errno));
-                            exit(1);
-                        }
-                    }
-                    break;
-                    //
-                    // KEYBOARD WRITE
-                    // 1) <cr> or <lf> mapping write
-                    //    mapping to shell, only <lf>
-                    //
-                    // 2) normal write
-                    //    forward to shell
-                    // *** We also check for SIGPIPE here
-                case 0x0D: // <cr>
-                case 0x0A: // <lf>
-                    if (forwarding && forward_fd_open) {
-                        write_wrap(forward_fd,lf,1, "to shell [1]");
-                    }
-                    break;
-                default:
-                    if (forwarding && forward_fd_open) {
-                        write_wrap(forward_fd, &buf[i],1, "to shell [2]");
-                    }
+        client_frames(s, inflate_buf);
+        latency_add(TO_SHELL, start);
+    }
+    pool_put(buf);
+    pool_put(inflate_buf);
+}
+
+// without compression shell output needs no changes on its way to the
+// client: splice() moves it from the pipe to the socket in the kernel.
+// Returns false if splice() is not supported and the caller must copy.
+bool shell_splice(struct session * s) {
+    while (!s->shutdown) {
+        uint64_t start = metrics_set ? now_ns() : 0;
+        int moved = splice_peer(s->shell_ev.fd, s->sock_ev.fd,
+                                buf_size > FRAME_BURST ? buf_size : FRAME_BURST, "shell to client");
+        if (moved > 0) {
+            traffic_add(s, TO_CLIENT, moved, moved, 0);
+            latency_add(TO_CLIENT, start);
+        }
+        if (moved == 0) {
+            session_end(s); // EOF from shell
+        }
+        else if (moved == -1) {
+            if (errno == EPIPE) {
+                client_lost(s);
             }
-            
-            /* ---------- check for SIGPIPE  ---------- */
-            if (received_sigpipe) {
-                close_wrap(forward_fd, 1001);
-                forward_fd_open = false;
-                shutdown = true;
+            else if (errno == EINVAL) {
+                s->no_splice = true;
+                return false;
             }
+            else if (errno == ENOSPC) {
+                s->stalled = true; // until EPOLLOUT
+                session_wait(s);
+            }
+            break; // EAGAIN, everything moved
         }
-        
-        // stop when no --shell option due to ^D
-        // look at "KEYBOARD escape sequence check" 1)
-        if (escape) {
+    }
+    return true;
+}
+
+// the shell has output (edge-triggered): forward it until EAGAIN.
+// With compression everything read in one go (up to FRAME_BURST bytes)
+// is sent as a single frame. With HELLO_MUX no more than the client's
+// window is read; the rest waits in the pipe until CTRL_WINDOW.
+void shell_event(struct event * ev, uint32_t events) {
+    (void) events;
+    struct session * s = ev->data;
+    bool framed = s->proto == PROTO_FRAMED;
+    bool mux = s->conn->mux;
+    if (s->proto == PROTO_UNKNOWN) {
+        return; // held until session_start()
+    }
+    if (!framed && !s->no_splice && outq_pending(&s->to_client, s->sock_ev.fd) == 0 &&
+        shell_splice(s)) {
+        return;
+    }
+    size_t burst_size = framed && buf_size < FRAME_BURST ? FRAME_BURST : buf_size;
+    char * buf_shellin = pool_get(burst_size);
+    size_t burst = 0;
+    int rcount_shellin;
+    bool eof = false;
+
+    while (!s->shutdown && !eof) {
+        uint64_t start = metrics_set ? now_ns() : 0;
+        // the rest waits in the pipe while the client is behind
+        if (outq_pending(&s->conn->to_client, s->conn->sock_ev.fd) >= OUTQ_HIGH) {
+            s->stalled = true;
+            session_wait(s);
             break;
         }
-        
+        size_t room = burst_size;
+        if (mux && s->window < (int64_t)room) {
+            if (s->window <= 0) {
+                s->stalled = true;
+                break;
+            }
+            room = s->window;
+        }
+        // fill the burst until the shell has nothing more right now
+        rcount_shellin = 0;
+        while (burst < room) {
+            size_t want = room - burst < buf_size ? room - burst : buf_size;
+            rcount_shellin = read_peer(ev->fd, buf_shellin + burst, want, "from shell [1]");
+            if (rcount_shellin <= 0) {
+                break;
+            }
+            burst += rcount_shellin;
+        }
+        // if EOF from shell, shut down after sending what was read
+        eof = rcount_shellin == 0;
+
         /*
          * -------------------- SHELL WRITE -------------------- *
          */
-        
+
         // SHELL INPUT forward to client
-        
-        if (rcount_shellin != -1) {
-            if (compress_set) {
-                def_bytes = zcompress_new(tmp_buf, buf_shellin, rcount_shellin, buf_size);
-                write_wrap(newsockfd, tmp_buf, def_bytes, "to client");
-            }
-            else {
-                write_wrap(newsockfd, buf_shellin, rcount_shellin, "to client");
+        if (burst > 0) {
+            if (record_set) {
+                log_record(&recorder, LOG_RECEIVED, s->id, buf_shellin, burst);
             }
+            client_send(s, buf_shellin, burst);
+            latency_add(TO_CLIENT, start);
+            burst = 0;
         }
-        
-        /*
-         * -------------------- SHUTDOWN -------------------- *
-         */
-        
-        if (shutdown) {
-            if (forward_fd_open) {
-                close_wrap(forward_fd, 1000);
+        if (rcount_shellin == -1) {
+            break; // EAGAIN, everything read
+        }
+    }
+    if (eof) {
+        session_end(s);
+    }
+    pool_put(buf_shellin);
+}
+
+// a new session of this worker, without a client or shell yet
+struct session * session_new() {
+    struct session * s = calloc(1, sizeof(struct session));
+    if (s == NULL) {
+        fprintf(stderr, "Error allocating session: %s\n", strerror(errno));
+        exit(1);
+    }
+    s->child_pid = -1;
+    s->id = __atomic_add_fetch(&sessions_started, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&self->lock);
+    s->next = sessions;
+    if (sessions != NULL) {
+        sessions->prev = s;
+    }
+    sessions = s;
+    sessions_open++;
+    pthread_mutex_unlock(&self->lock);
+    return s;
+}
+
+// a session for the client on socket fd, which it starts by sending
+struct session * session_accept(int fd) {
+    struct session * s = session_new();
+    s->conn = s;
+    // shell output has to pass through the recorder, and with
+    // io_uring splice() could overtake queued writes
+    s->no_splice = record_set || io_uring_on;
+    s->proto = PROTO_UNKNOWN;
+    frame_reader_init(&s->in);
+
+    s->sock_ev.fd = fd;
+    s->sock_ev.handler = client_event;
+    s->sock_ev.data = s;
+    reactor_add(epfd, &s->sock_ev, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+    return s;
+}
+
+// accept pending connections (edge-triggered) and start their sessions
+void listen_event(struct event * ev, uint32_t events) {
+    (void) events;
+    while (1) {
+        // TCP or Unix socket, the client's address is not needed
+        int newsockfd = accept4(ev->fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+        if (newsockfd == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+            fprintf(stderr, "Error establishing connection with client: %s\n", strerror(errno));
+            // the client may already have given up, keep serving the others
+            if (errno == ECONNABORTED || errno == EINTR) {
+                continue;
             }
-            if (read_fd_open) {
-                close_wrap(read_fd, 2000);
+            if (errno == EMFILE || errno == ENFILE) {
+                return;
+            }
+            exit(1);
+        }
+
+        session_accept(newsockfd);
+    }
+}
+
+// clients handed over by other workers to resume a session of this one:
+// each starts like a new client whose HELLO (and what followed) was
+// already read
+void handoff_event(struct event * ev, uint32_t events) {
+    (void) events;
+    uint64_t count;
+    if (read(ev->fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        fprintf(stderr, "Error reading handoffs: %s\n", strerror(errno));
+        exit(1);
+    }
+    pthread_mutex_lock(&self->lock);
+    struct handoff * h = self->handoffs;
+    self->handoffs = NULL;
+    pthread_mutex_unlock(&self->lock);
+    while (h != NULL) {
+        struct handoff * next = h->next;
+        struct session * s = session_accept(h->fd);
+        frame_reader_append(&s->in, h->in, h->len);
+        if (session_start(s) == -1) {
+            session_end(s);
+        }
+        else if (s->proto == PROTO_FRAMED) {
+            char * inflate_buf = pool_get(buf_size);
+            client_frames(s, inflate_buf); // the session was not resumed after all
+            pool_put(inflate_buf);
+        }
+        free(h);
+        h = next;
+    }
+}
+
+// the metrics in the Prometheus text format, in a malloc()ed string
+char * metrics_text(size_t * len) {
+    static const char * dirs[2] = {"to_shell", "to_client"};
+    char * text;
+    FILE * out = open_memstream(&text, len);
+    if (out == NULL) {
+        fprintf(stderr, "Error creating metrics: %s\n", strerror(errno));
+        exit(1);
+    }
+    char labels[64];
+    int dir, w;
+
+    // the sums over all workers
+    int open = 0, detached = 0;
+    struct io_stats io;
+    struct traffic sum[2];
+    struct histogram lat[2];
+    memset(&io, 0, sizeof(io));
+    memset(sum, 0, sizeof(sum));
+    memset(lat, 0, sizeof(lat));
+    for (w = 0; w < nworkers; w++) {
+        struct worker * wk = &workers[w];
+        open += *wk->sessions_open;
+        detached += *wk->sessions_detached;
+        io.syscalls += wk->io->syscalls;
+        io.wakeups += wk->io->wakeups;
+        io.events += wk->io->events;
+        histogram_merge(&io.queue, &wk->io->queue);
+        for (dir = 0; dir < 2; dir++) {
+            sum[dir].data += wk->traffic[dir].data;
+            sum[dir].wire += wk->traffic[dir].wire;
+            sum[dir].frames += wk->traffic[dir].frames;
+            histogram_merge(&lat[dir], &wk->latency[dir]);
+        }
+    }
+
+    fprintf(out, "# HELP twoface_sessions_started_total Sessions accepted.\n"
+                 "# TYPE twoface_sessions_started_total counter\n"
+                 "twoface_sessions_started_total %u\n",
+            __atomic_load_n(&sessions_started, __ATOMIC_RELAXED));
+    fprintf(out, "# HELP twoface_sessions_open Sessions not yet closed.\n"
+                 "# TYPE twoface_sessions_open gauge\n"
+                 "twoface_sessions_open %d\n", open);
+    fprintf(out, "# HELP twoface_sessions_detached Sessions waiting for their client to resume them.\n"
+                 "# TYPE twoface_sessions_detached gauge\n"
+                 "twoface_sessions_detached %d\n", detached);
+    fprintf(out, "# HELP twoface_worker_sessions_open Sessions not yet closed, per worker.\n"
+                 "# TYPE twoface_worker_sessions_open gauge\n");
+    for (w = 0; w < nworkers; w++) {
+        fprintf(out, "twoface_worker_sessions_open{worker=\"%d\"} %d\n", w,
+                *workers[w].sessions_open);
+    }
+    fprintf(out, "# HELP twoface_syscalls_total I/O system calls of the event loops.\n"
+                 "# TYPE twoface_syscalls_total counter\n"
+                 "twoface_syscalls_total %llu\n", (unsigned long long)io.syscalls);
+    fprintf(out, "# HELP twoface_wakeups_total epoll_wait() calls that returned events.\n"
+                 "# TYPE twoface_wakeups_total counter\n"
+                 "twoface_wakeups_total %llu\n", (unsigned long long)io.wakeups);
+    fprintf(out, "# HELP twoface_events_total Ready events handled.\n"
+                 "# TYPE twoface_events_total counter\n"
+                 "twoface_events_total %llu\n", (unsigned long long)io.events);
+
+    fprintf(out, "# HELP twoface_bytes_total Data bytes, before compression.\n"
+                 "# TYPE twoface_bytes_total counter\n");
+    for (dir = 0; dir < 2; dir++) {
+        fprintf(out, "twoface_bytes_total{direction=\"%s\"} %llu\n", dirs[dir],
+                (unsigned long long)sum[dir].data);
+    }
+    fprintf(out, "# HELP twoface_wire_bytes_total Bytes on the client sockets.\n"
+                 "# TYPE twoface_wire_bytes_total counter\n");
+    for (dir = 0; dir < 2; dir++) {
+        fprintf(out, "twoface_wire_bytes_total{direction=\"%s\"} %llu\n", dirs[dir],
+                (unsigned long long)sum[dir].wire);
+    }
+    fprintf(out, "# HELP twoface_frames_total Frames, including control frames.\n"
+                 "# TYPE twoface_frames_total counter\n");
+    for (dir = 0; dir < 2; dir++) {
+        fprintf(out, "twoface_frames_total{direction=\"%s\"} %llu\n", dirs[dir],
+                (unsigned long long)sum[dir].frames);
+    }
+    fprintf(out, "# HELP twoface_compression_ratio Wire bytes per data byte.\n"
+                 "# TYPE twoface_compression_ratio gauge\n");
+    for (dir = 0; dir < 2; dir++) {
+        fprintf(out, "twoface_compression_ratio{direction=\"%s\"} %.4f\n", dirs[dir],
+                sum[dir].data ? (double)sum[dir].wire / sum[dir].data : 1.0);
+    }
+
+    fprintf(out, "# HELP twoface_latency_seconds From reading data to having written it on.\n"
+                 "# TYPE twoface_latency_seconds histogram\n");
+    for (dir = 0; dir < 2; dir++) {
+        snprintf(labels, sizeof(labels), "direction=\"%s\"", dirs[dir]);
+        histogram_print(out, "twoface_latency_seconds", labels, &lat[dir]);
+    }
+    fprintf(out, "# HELP twoface_queue_delay_seconds From epoll_wait() returning to the handler.\n"
+                 "# TYPE twoface_queue_delay_seconds histogram\n");
+    histogram_print(out, "twoface_queue_delay_seconds", "", &io.queue);
+
+    // every open session
+    static const char * names[3] = {"bytes", "wire_bytes", "frames"};
+    int n;
+    for (n = 0; n < 3; n++) {
+        fprintf(out, "# HELP twoface_session_%s_total Like twoface_%s_total, per open session.\n"
+                     "# TYPE twoface_session_%s_total counter\n", names[n], names[n], names[n]);
+        for (w = 0; w < nworkers; w++) {
+            pthread_mutex_lock(&workers[w].lock);
+            struct session * s;
+            for (s = *workers[w].sessions; s != NULL; s = s->next) {
+                for (dir = 0; dir < 2; dir++) {
+                    uint64_t v = n == 0 ? s->traffic[dir].data :
+                                 n == 1 ? s->traffic[dir].wire : s->traffic[dir].frames;
+                    fprintf(out, "twoface_session_%s_total{session=\"%u\",direction=\"%s\"} %llu\n",
+                            names[n], s->id, dirs[dir], (unsigned long long)v);
+                }
             }
+            pthread_mutex_unlock(&workers[w].lock);
+        }
+    }
+    fclose(out);
+    return text;
+}
+
+// a metrics connection is ready (edge-triggered): read the request
+// (HTTP), then write the text until EAGAIN or done
+void metrics_conn_event(struct event * ev, uint32_t events) {
+    (void) events;
+    struct metrics_conn * m = ev->data;
+    char buf[512];
+    int rcount;
+    while (!m->answered) {
+        rcount = read_peer(ev->fd, buf, sizeof(buf), "metrics request");
+        if (rcount == -1) {
+            return; // EAGAIN, more of the request to come
+        }
+        if (rcount == 0) {
             break;
         }
+        // the request ends with an empty line
+        int i;
+        for (i = 0; i < rcount; i++) {
+            memmove(m->req, m->req + 1, 3);
+            m->req[3] = buf[i];
+        }
+        m->answered = memcmp(m->req, "\r\n\r\n", 4) == 0 || memcmp(m->req + 2, "\n\n", 2) == 0;
+    }
+    if (m->text == NULL) {
+        size_t len;
+        char * body = metrics_text(&len);
+        if (metrics_http) {
+            char * text;
+            FILE * out = open_memstream(&text, &m->len);
+            if (out == NULL) {
+                fprintf(stderr, "Error creating metrics: %s\n", strerror(errno));
+                exit(1);
+            }
+            fprintf(out, "HTTP/1.0 200 OK\r\n"
+                         "Content-Type: text/plain; version=0.0.4\r\n"
+                         "Content-Length: %zu\r\n"
+                         "Connection: close\r\n\r\n", len);
+            fwrite(body, 1, len, out);
+            fclose(out);
+            free(body);
+            m->text = text;
+        }
+        else {
+            m->text = body;
+            m->len = len;
+        }
+    }
+    while (m->off < m->len) {
+        io_stats.syscalls++;
+        ssize_t wcount = write(ev->fd, m->text + m->off, m->len - m->off);
+        if (wcount == -1) {
+            if (errno == EAGAIN || errno == EINTR) {
+                return; // wait for room
+            }
+            break; // reader gone
+        }
+        m->off += wcount;
+    }
+    // this fd is in no other batch entry, so m can go right away
+    reactor_del(epfd, ev);
+    close_wrap(ev->fd, 4000);
+    free(m->text);
+    free(m);
+}
+
+// accept metrics connections (edge-triggered)
+void metrics_event(struct event * ev, uint32_t events) {
+    (void) events;
+    while (1) {
+        int fd = accept4(ev->fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+        if (fd == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EMFILE || errno == ENFILE) {
+                return;
+            }
+            if (errno == ECONNABORTED || errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Error accepting metrics connection: %s\n", strerror(errno));
+            exit(1);
+        }
+        struct metrics_conn * m = calloc(1, sizeof(struct metrics_conn));
+        if (m == NULL) {
+            fprintf(stderr, "Error allocating metrics connection: %s\n", strerror(errno));
+            exit(1);
+        }
+        m->answered = !metrics_http; // nothing to read on the Unix socket
+        m->ev.fd = fd;
+        m->ev.handler = metrics_conn_event;
+        m->ev.data = m;
+        reactor_add(epfd, &m->ev, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+    }
+}
+
+// listen for metrics readers: arg is a port number (HTTP on the
+// loopback interface) or the path of a Unix socket
+void metrics_socket(const char * arg) {
+    char * end;
+    long port = strtol(arg, &end, 10);
+    metrics_http = *arg != '\0' && *end == '\0';
+    int sockfd;
+    if (metrics_http) {
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(port);
+        sockfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+        int on = 1;
+        if (sockfd == -1 ||
+            setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1 ||
+            bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+            fprintf(stderr, "Error with metrics port %s: %s\n", arg, strerror(errno));
+            exit(1);
+        }
+        if (listen(sockfd, SOMAXCONN) == -1) {
+            fprintf(stderr, "Error listening on metrics socket: %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+    else {
+        sockfd = unix_socket(arg);
+    }
+    metrics_ev.fd = sockfd;
+    metrics_ev.handler = metrics_event;
+    reactor_add(epfd, &metrics_ev, EPOLLIN | EPOLLET);
+}
+
+// SIGINT or SIGTERM arrived (option --record)
+void stop_event(struct event * ev, uint32_t events) {
+    (void) ev;
+    (void) events;
+    __atomic_store_n(&stopping, true, __ATOMIC_RELAXED);
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) == -1) {
+        fprintf(stderr, "Error waking workers: %s\n", strerror(errno));
+        exit(1);
+    }
+}
+
+// the other workers only need to wake up and see stopping
+void wake_event(struct event * ev, uint32_t events) {
+    (void) ev;
+    (void) events;
+}
+
+// block the stop signals for all threads (before they are started)
+// and take them through stop_ev, registered by worker 0
+void stop_start() {
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    if (sigprocmask(SIG_BLOCK, &stop_signals, NULL) == -1) {
+        fprintf(stderr, "Error blocking signals: %s\n", strerror(errno));
+        exit(1);
+    }
+    stop_ev.fd = signalfd(-1, &stop_signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (stop_ev.fd == -1) {
+        fprintf(stderr, "Error creating signalfd: %s\n", strerror(errno));
+        exit(1);
+    }
+    stop_ev.handler = stop_event;
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd == -1) {
+        fprintf(stderr, "Error creating eventfd: %s\n", strerror(errno));
+        exit(1);
+    }
+}
+
+// set up the event loop of worker w in the calling thread
+void worker_start(struct worker * w) {
+    self = w;
+    w->sessions = &sessions;
+    w->sessions_open = &sessions_open;
+    w->sessions_detached = &sessions_detached;
+    w->traffic = traffic;
+    w->latency = latency;
+    w->io = &io_stats;
+    epfd = reactor_create();
+    if (io_uring_set) {
+        io_uring_on = reactor_uring(epfd) == 0;
+        if (!io_uring_on) {
+            fprintf(stderr, "io_uring not available (%s), using epoll\n", strerror(errno));
+        }
     }
+    listen_ev.fd = w->listen_fd;
+    unix_ev.fd = unix_fd;
+    if (metrics_set) {
+        io_stats.timing = 1;
+    }
+    if (wake_fd != -1) {
+        wake_ev.fd = wake_fd;
+        wake_ev.handler = wake_event;
+        reactor_add(epfd, &wake_ev, EPOLLIN); // level-triggered, never read
+    }
+    if (w->handoff_fd != -1) {
+        handoff_ev.fd = w->handoff_fd;
+        handoff_ev.handler = handoff_event;
+        reactor_add(epfd, &handoff_ev, EPOLLIN);
+    }
+    if (forwarding && shell_pool_size > 0) {
+        shell_pool_start();
+    }
+    pthread_barrier_wait(&workers_ready);
+}
+
+void serve();
+
+// a worker thread other than worker 0
+void * worker_thread(void * arg) {
+    worker_start(arg);
+    serve();
+    return NULL;
+}
+
+// accept clients and run all sessions until the server is killed
+// (or with --record, stopped by SIGINT or SIGTERM)
+void serve() {
+    if (listen_ev.fd != -1) {
+        listen_ev.handler = listen_event;
+        reactor_add(epfd, &listen_ev, EPOLLIN | EPOLLET);
+    }
+    if (unix_fd != -1) {
+        unix_ev.handler = listen_event;
+        reactor_add(epfd, &unix_ev, EPOLLIN | EPOLLET | (nworkers > 1 ? EPOLLEXCLUSIVE : 0));
+    }
+
+    while(!__atomic_load_n(&stopping, __ATOMIC_RELAXED)){
+        // sleep until a client, shell or listening socket is ready
+        reactor_run(epfd, -1);
+
+        // sessions that wait for the ring to write a queue out
+        struct session * w = waiting;
+        waiting = NULL;
+        while (w != NULL) {
+            struct session * s = w;
+            w = s->next_waiting;
+            s->waiting = false;
+            session_drained(s);
+        }
+
+        // drop the sessions that have ended
+        while (closing != NULL) {
+            struct session * s = closing;
+            closing = s->next_closing;
+            session_close(s);
+        }
+    }
+}
+
+// a whole decimal number from min to max for a numeric option: no
+// sign, no trailing characters; -1 if arg is not one
+long option_num(const char * arg, long min, long max) {
+    char * end;
+    if (*arg < '0' || *arg > '9') {
+        return -1;
+    }
+    errno = 0;
+    long num = strtol(arg, &end, 10);
+    if (*end != '\0' || errno == ERANGE || num < min || num > max) {
+        return -1;
+    }
+    return num;
 }
 
 /*
@@ -286,123 +2076,177 @@ void term_rw (bool forwarding, bool compress_set) {
  */
 int main(int argc, char * argv[]) {
     bool port_set = false;
-    bool shell_set = false;
-    bool compress_set = false;
-    
-    char * program;
+    char * metrics_arg = NULL;
+    long num;
+
     int opt;
     while((opt = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
         switch (opt) {
             case 'p':
                 port_set = true;
-                portnum = atoi(optarg);
+                num = option_num(optarg, 1, 65535);
+                if (num == -1) {
+                    fprintf(stderr, "Error with --port: must be 1 to 65535\n");
+                    exit(1);
+                }
+                portnum = num;
                 break;
             case 's':
-                shell_set = true;
+                forwarding = true;
                 program = optarg;
                 break;
             case 'c':
-                compress_set = true;
+                if (codec_parse(optarg, &server_codec, &server_level) == -1) {
+                    fprintf(stderr, "Error with --compress: unknown codec %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'b':
+                num = option_num(optarg, 1, FRAME_MAX);
+                if (num == -1) {
+                    fprintf(stderr, "Error with --bufsize: must be 1 to %d bytes\n", FRAME_MAX);
+                    exit(1);
+                }
+                buf_size = num;
+                break;
+            case 'd':
+                dict_load(optarg);
+                break;
+            case 't':
+                pty_allowed = true;
+                break;
+            case 'R':
+                record_set = true;
+                record_open(&recorder, optarg);
+                break;
+            case 'm':
+                metrics_set = true;
+                metrics_arg = optarg;
+                break;
+            case 'u':
+                unix_path = optarg;
+                break;
+            case 'w':
+                num = option_num(optarg, 1, 256);
+                if (num == -1) {
+                    fprintf(stderr, "Error with --workers: must be 1 to 256\n");
+                    exit(1);
+                }
+                nworkers = num;
+                break;
+            case 'i':
+                if (strcmp(optarg, "uring") == 0) {
+                    io_uring_set = true;
+                }
+                else if (strcmp(optarg, "epoll") != 0) {
+                    fprintf(stderr, "Error with --io: epoll or uring\n");
+                    exit(1);
+                }
+                break;
+            case 'P':
+                num = option_num(optarg, 0, POOL_MAX);
+                if (num == -1) {
+                    fprintf(stderr, "Error with --pool: must be 0 to %d shells\n", POOL_MAX);
+                    exit(1);
+                }
+                shell_pool_size = num;
+                break;
+            case 'D':
+                num = option_num(optarg, 1, INT_MAX);
+                if (num == -1) {
+                    fprintf(stderr, "Error with --detach: must be a whole number of seconds, at least 1\n");
+                    exit(1);
+                }
+                detach_timeout = num;
+                break;
+            case 'S':
+                num = option_num(optarg, 1, SCROLLBACK_MAX);
+                if (num == -1) {
+                    fprintf(stderr, "Error with --scrollback: must be 1 to %d bytes\n", SCROLLBACK_MAX);
+                    exit(1);
+                }
+                scrollback_size = num;
+                break;
+            case 'r':
+                num = option_num(optarg, 1, POOL_RATE_MAX);
+                if (num == -1) {
+                    fprintf(stderr, "Error with --pool-rate: must be 1 to %d shells per second\n", POOL_RATE_MAX);
+                    exit(1);
+                }
+                shell_pool_rate = num;
                 break;
             default:
-                fprintf(stderr, "usage: ./twoface-server --port=<num> [--shell=<program>] [--compress]\n");
+                fprintf(stderr, "usage: ./twoface-server --port=<num> [--shell=<program>] [--compress[=<codec>[:<level>]]] [--bufsize=<bytes>] [--dict=<file>] [--pool=<num>] [--pool-rate=<num>] [--pty] [--record=<file>] [--metrics=<path>|<port>] [--unix=<path>] [--io=epoll|uring] [--workers=<num>] [--detach=<sec>] [--scrollback=<bytes>]\n");
                 exit(1);
         }
     }
-    
-    // --port mandatory
-    if (!port_set) {
-        fprintf(stderr, "usage: ./twoface-server --port=<num> [--shell=<program>] [--compress]\n");
+
+    // --port and/or --unix mandatory
+    if (!port_set && unix_path == NULL) {
+        fprintf(stderr, "usage: ./twoface-server --port=<num> [--shell=<program>] [--compress[=<codec>[:<level>]]] [--bufsize=<bytes>] [--dict=<file>] [--pool=<num>] [--pool-rate=<num>] [--pty] [--record=<file>] [--metrics=<path>|<port>] [--unix=<path>] [--io=epoll|uring] [--workers=<num>] [--detach=<sec>] [--scrollback=<bytes>]\n");
         exit(1);
     }
-    
-    // connect with client
-    server_socket();
-    
-    // --shell mode
-    if (shell_set) {
-        // create pipes
-        int pipe_in[2], pipe_out[2]; // pipes into shell and out of shell
-        if (pipe(pipe_in) == -1 || pipe(pipe_out) == -1) {
-            fprintf(stderr, "Error creating pipe: %s\n", strerror(errno));
-            exit(1);
-        }
-        
-        // fork process
-        pid_t pid = fork();
-        if (pid == -1) {
-            fprintf(stderr, "Error forking: %s\n", strerror(errno));
-            exit(1);
-        }
-        
-        // child process (shell)
-        if (pid == 0) {
-            // make stdin pipe from terminal process
-            close_wrap(0, 0);
-            dup_wrap(pipe_in[READ], 0);
-            close_wrap(pipe_in[READ], 1);
-            
-            // make stdout and stderr dups of pipe to terminal
-            close_wrap(1, 2);
-            dup_wrap(pipe_out[WRITE], 2);
-            close_wrap(2, 3);
-            dup_wrap(pipe_out[WRITE], 3);
-            close_wrap(pipe_out[WRITE], 4);
-            
-            //close the rest of the pipe file descriptors
-            close_wrap(pipe_in[WRITE], 5);
-            
-            // create shell from child process
-            char * args[] = {program, NULL};
-            if (execvp(*args, args) == -1) {
-                fprintf(stderr, "Error with execv: %s\n", strerror(errno));
+
+    // a client or shell that goes away only ends its own session:
+    // writes to it fail with EPIPE instead of raising SIGPIPE
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+        fprintf(stderr, "Error ignoring SIGPIPE: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    // listen for clients, on a socket of its own for every worker
+    workers = calloc(nworkers, sizeof(struct worker));
+    if (workers == NULL) {
+        fprintf(stderr, "Error allocating workers: %s\n", strerror(errno));
+        exit(1);
+    }
+    int w;
+    for (w = 0; w < nworkers; w++) {
+        workers[w].listen_fd = port_set ? server_socket() : -1;
+        pthread_mutex_init(&workers[w].lock, NULL);
+        workers[w].handoff_fd = -1;
+        if (detach_timeout > 0 && nworkers > 1) {
+            workers[w].handoff_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (workers[w].handoff_fd == -1) {
+                fprintf(stderr, "Error creating eventfd: %s\n", strerror(errno));
                 exit(1);
             }
         }
-        // parent process (terminal)
-        else {
-            child_pid = pid;
-            //set signal handler for SIGPIPE
-            if (signal(SIGPIPE,handler) == SIG_ERR) {
-                fprintf(stderr, "Error setting signal handler for SIGPIPE: %s\n", strerror(errno));
-                exit(1);
-            }
-            //close pipe fds used by child
-            close_wrap(pipe_in[READ], 7);
-            close_wrap(pipe_out[WRITE], 8);
-            // set read, write file descriptors
-            forward_fd = pipe_in[WRITE];
-            read_fd    = pipe_out[READ];
-            //set polls
-            fds[0].fd = newsockfd;
-            fds[0].events = POLLIN | POLLHUP | POLLERR;
-            fds[1].fd = read_fd;
-            fds[1].events = POLLIN | POLLHUP | POLLERR;
-            // terminal
-            term_rw(true, compress_set);
-            
-            // wait for child process to end
-            int status;
-            if (waitpid(pid, &status, 0) == -1) {
-                fprintf(stderr, "Error with waitpid: %s\n", strerror(errno));
-                exit(1);
-            }
-            int child_exit_signal = WTERMSIG(status);
-            // alternatively use: = 0x007f & status;
-            
-            int child_exit_status = WEXITSTATUS(status);
-            // alternatively use:  = (0xff00 & status) >> 8;
-            
-            fprintf(stderr, "SHELL EXIT SIGNAL=%d STATUS=%d\n", child_exit_signal, child_exit_status);
-            
-            //close connection to socket
-            shutdown(newsockfd, SHUT_RDWR);
-        }
-    }
-    
-    // no --shell mode
-    else {
-        term_rw(false, compress_set);
+    }
+    if (unix_path != NULL) {
+        unix_fd = unix_socket(unix_path);
+    }
+    if (record_set) {
+        stop_start();
+    }
+
+    // start the workers, worker 0 in this thread
+    pthread_barrier_init(&workers_ready, NULL, nworkers);
+    for (w = 1; w < nworkers; w++) {
+        int err = pthread_create(&workers[w].thread, NULL, worker_thread, &workers[w]);
+        if (err != 0) {
+            fprintf(stderr, "Error creating worker thread: %s\n", strerror(err));
+            exit(1);
+        }
+    }
+    worker_start(&workers[0]);
+    if (record_set) {
+        reactor_add(epfd, &stop_ev, EPOLLIN);
+    }
+    if (metrics_set) {
+        metrics_socket(metrics_arg);
+    }
+
+    // sessions
+    serve();
+    for (w = 1; w < nworkers; w++) {
+        pthread_join(workers[w].thread, NULL);
+    }
+    if (record_set) {
+        log_close(&recorder);
+    }
+    if (unix_path != NULL && unix_path[0] != '@') {
+        unlink(unix_path);
     }
     exit(0);
 }